@@ -0,0 +1,59 @@
+#!/bin/sh
+# DT PS Tree
+#
+# Douglas Thrift
+#
+# bench.sh
+
+#  Copyright 2010 Douglas Thrift
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+
+# Usage: bench.sh DTPSTREE GENERATE [COUNT [RUNS]]
+#
+# Generates a table of COUNT processes for each shape and renders it RUNS
+# times with each set of options, writing one tab separated line for each
+# line of --stats:
+#
+#   shape  count  options  run  name  value
+
+set -e
+
+dtpstree=$1
+generate=$2
+count=${3:-20000}
+runs=${4:-3}
+
+[ -n "$dtpstree" ] && [ -n "$generate" ] || {
+	echo "Usage: $0 DTPSTREE GENERATE [COUNT [RUNS]]" >&2
+	exit 1
+}
+
+directory=`mktemp -d "${TMPDIR:-/tmp}/dtpstree.XXXXXX"`
+trap 'rm -rf "$directory"' EXIT INT TERM
+
+printf 'shape\tcount\toptions\trun\tname\tvalue\n'
+
+for shape in chain wide pools argv multibyte mixed; do
+	"$generate" $shape $count "$directory/$shape"
+
+	for options in -A -Ac -Ap -An -Aa -Al -At; do
+		run=1
+
+		while [ $run -le $runs ]; do
+			"$dtpstree" $options --stats --load-snapshot "$directory/$shape" 2>&1 >/dev/null |
+				sed -e "s/^\([^ ]*\) /$shape	$count	$options	$run	\1	/"
+			run=`expr $run + 1`
+		done
+	done
+done
@@ -0,0 +1,68 @@
+#!/bin/sh
+# DT PS Tree
+#
+# Douglas Thrift
+#
+# check.sh
+
+#  Copyright 2010 Douglas Thrift
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+
+# Usage: check.sh DTPSTREE GENERATE
+#
+# Draws generated tables with --max-lines, alone and with --top and
+# --max-depth, and checks that the processes drawn, the ones the lines
+# those options leave in their place stand for, and the ones the last line
+# says were left out add up to the whole table, whatever depth the budget
+# runs out at.
+
+set -e
+
+dtpstree=$1
+generate=$2
+count=400
+
+[ -n "$dtpstree" ] && [ -n "$generate" ] || {
+	echo "Usage: $0 DTPSTREE GENERATE" >&2
+	exit 1
+}
+
+directory=`mktemp -d "${TMPDIR:-/tmp}/dtpstree.XXXXXX"`
+trap 'rm -rf "$directory"' EXIT INT TERM
+
+failed=0
+
+for shape in mixed argv; do
+	"$generate" $shape $count "$directory/$shape"
+
+	for options in "" --top=5 --top=20 --max-depth=2 --max-depth=4 "--top=20 --max-depth=3"; do
+		for lines in 3 4 5 8 13 21 34 55; do
+			"$dtpstree" -Acp $options --max-lines=$lines --load-snapshot "$directory/$shape" >"$directory/tree"
+
+			drawn=`grep -o '([0-9][0-9]*)' "$directory/tree" | wc -l`
+			labels=`sed -e '$ {/ more processes$/d;}' "$directory/tree" | grep -o '\.\.\. [0-9][0-9]* more\|+[0-9][0-9]* descendant' | sed -e 's/[^0-9]//g' | awk '{ sum += $1 } END { print sum + 0 }'`
+			more=`sed -e '$ s/^\.\.\. \([0-9][0-9]*\) more processes$/\1/p;d' "$directory/tree"`
+			total=`expr $drawn + $labels + ${more:-0}`
+
+			if [ $total -eq $count ]; then
+				echo "ok $shape $options --max-lines=$lines"
+			else
+				echo "FAIL $shape $options --max-lines=$lines: $drawn drawn, $labels in labels and ${more:-0} more of $count"
+				failed=1
+			fi
+		done
+	done
+done
+
+exit $failed
@@ -19,13 +19,17 @@
  *  limitations under the License.
  */
 
+#include <algorithm>
 #include <cerrno>
 #include <climits>
 #include <clocale>
+#include <csignal>
 #include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <cwchar>
 #include <iostream>
 #include <map>
 #include <sstream>
@@ -50,22 +54,434 @@
 
 #include <err.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
-#include <kvm.h>
 #include <paths.h>
 #include <pwd.h>
+#include <regex.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/param.h>
-#include <sys/sysctl.h>
-#include <sys/user.h>
+#include <sys/resource.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 #include <vis.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_PROCFS
+#include <dirent.h>
+#else
+#include <kvm.h>
+#include <sys/sysctl.h>
+#include <sys/user.h>
+#endif
+
 #include "foreach.hpp"
+#include "snapshot.hpp"
+
+namespace workers
+{
+
+// a few threads are enough to keep the kernel busy reading /proc or to get
+// through a big tree, and none are worth starting for less than Least
+// processes each
+const size_t Most(16), Least(256);
+
+inline size_t count(size_t items)
+{
+#ifdef HAVE_PTHREAD_H
+	long online(sysconf(_SC_NPROCESSORS_ONLN));
+
+	return std::max<size_t>(std::min<size_t>(std::min<size_t>(online > 0 ? online : 1, Most), items / Least), 1);
+#else
+	return 1;
+#endif
+}
+
+template <typename Job>
+struct Range
+{
+	Job *job_;
+	size_t begin_, end_, worker_;
+};
+
+template <typename Job>
+void *run(void *data)
+{
+	Range<Job> *range(static_cast<Range<Job> *>(data));
+
+	(*range->job_)(range->begin_, range->end_, range->worker_);
+
+	return NULL;
+}
+
+// job(begin, end, worker) for each of count contiguous ranges of items; the
+// calling thread does the first, along with any a thread could not be
+// started for, so the results only depend on how the items were split
+template <typename Job>
+void split(Job &job, size_t items, size_t count)
+{
+	std::vector<Range<Job> > ranges(count);
+
+	_repeat (count)
+	{
+		Range<Job> range = { &job, items * _index / count, items * (_index + 1) / count, _index };
+
+		ranges[_index] = range;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	std::vector<pthread_t> threads(count);
+	std::vector<char> started(count);
+
+	for (size_t index(1); index != count; ++index)
+		started[index] = !pthread_create(&threads[index], NULL, run<Job>, &ranges[index]);
+#endif
+
+	run<Job>(&ranges[0]);
+
+	for (size_t index(1); index != count; ++index)
+#ifdef HAVE_PTHREAD_H
+		if (started[index])
+			pthread_join(threads[index], NULL);
+		else
+#endif
+			run<Job>(&ranges[index]);
+}
+
+}
+
+#ifdef HAVE_PROCFS
+namespace proc
+{
+
+const char *Path("/proc");
+
+// from <linux/sched.h>, which is not safe to include from userland
+const unsigned KernelThread(0x00200000);
+
+struct Proc
+{
+	pid_t pid_, ppid_;
+	uid_t ruid_;
+	unsigned threads_;
+	unsigned long long start_, rss_, cpu_;
+	char comm_[64];
+};
+
+class Table
+{
+	// where prefetch() left the command line of each of procs_, in the
+	// buffer of the worker that read it, unless its size_ is Unfetched
+	static const ssize_t Unfetched = -2;
+
+	struct Cmdline
+	{
+		size_t worker_, offset_;
+		ssize_t size_;
+	};
+
+	// the stat files of pids_[begin, end) into procs_[begin, end)
+	struct Stat
+	{
+		Table *table_;
+		std::vector<char> found_;
+
+		void operator()(size_t begin, size_t end, size_t)
+		{
+			std::vector<char> buffer(1024);
+
+			for (size_t index(begin); index != end; ++index)
+				found_[index] = table_->stat(table_->pids_[index], table_->procs_[index], buffer);
+		}
+	};
+
+	// the cmdline files of procs[begin, end) appended to buffers_[worker],
+	// skipping any an earlier prefetch() since getprocs() already read
+	struct Fetch
+	{
+		Table *table_;
+		const Proc *const *procs_;
+
+		void operator()(size_t begin, size_t end, size_t worker)
+		{
+			std::vector<char> buffer(1024), &cmdlines(table_->buffers_[worker]);
+
+			for (size_t index(begin); index != end; ++index)
+			{
+				Cmdline &cmdline(table_->cmdlines_[procs_[index] - &table_->procs_[0]]);
+
+				if (cmdline.size_ != Unfetched)
+					continue;
+
+				cmdline.worker_ = worker;
+				cmdline.offset_ = cmdlines.size();
+				cmdline.size_ = table_->cmdline(procs_[index], buffer);
+
+				if (cmdline.size_ > 0)
+					cmdlines.insert(cmdlines.end(), &buffer[0], &buffer[0] + cmdline.size_ + 1);
+			}
+		}
+	};
+
+	int proc_;
+	std::vector<pid_t> pids_;
+	std::vector<Proc> procs_;
+	std::vector<Cmdline> cmdlines_;
+	std::vector<std::vector<char> > buffers_;
+	std::vector<char> buffer_;
+	std::vector<char *> argv_;
+	long page_, tick_;
+	char error_[_POSIX2_LINE_MAX];
+
+public:
+	Table() : proc_(-1), buffer_(1024), page_(sysconf(_SC_PAGESIZE)), tick_(sysconf(_SC_CLK_TCK)) { *error_ = '\0'; }
+
+	bool open(char *error)
+	{
+		if ((proc_ = ::open(Path, O_RDONLY | O_DIRECTORY)) == -1)
+		{
+			std::snprintf(error, _POSIX2_LINE_MAX, "%s: %s", Path, std::strerror(errno));
+
+			return false;
+		}
+
+		return true;
+	}
+
+	Proc *getprocs(int &count)
+	{
+		int fd(dup(proc_));
+		DIR *dir(fd == -1 ? NULL : fdopendir(fd));
+
+		if (!dir)
+		{
+			if (fd != -1)
+				close(fd);
+
+			std::snprintf(error_, sizeof (error_), "%s: %s", Path, std::strerror(errno));
+
+			return NULL;
+		}
+
+		// the duplicate shares its offset with proc_, which the last call
+		// left at the end
+		rewinddir(dir);
+
+		pids_.clear();
+
+		while (dirent *entry = readdir(dir))
+		{
+			char *end;
+			long pid(std::strtol(entry->d_name, &end, 10));
+
+			if (end == entry->d_name || *end != '\0' || pid <= 0 || pid > INT_MAX)
+				continue;
+
+			pids_.push_back(pid);
+		}
+
+		closedir(dir);
+
+		// read in parallel and then squeezed together in readdir() order,
+		// so the table is the same however it was split up
+		Stat stat = { this, std::vector<char>(pids_.size()) };
+
+		procs_.resize(pids_.size());
+
+		workers::split(stat, pids_.size(), workers::count(pids_.size()));
+
+		size_t size(0);
+
+		_repeat (procs_.size())
+			if (stat.found_[_index])
+				procs_[size++] = procs_[_index];
+
+		procs_.resize(size);
+
+		Cmdline none = { 0, 0, Unfetched };
+
+		cmdlines_.assign(size, none);
+		buffers_.clear();
+
+		count = procs_.size();
+
+		return procs_.empty() ? NULL : &procs_[0];
+	}
+
+	// read the command lines of procs ahead of getargv() asking for them
+	void prefetch(const Proc *const *procs, size_t count)
+	{
+		size_t threads(workers::count(count));
+		Fetch fetch = { this, procs };
+
+		buffers_.resize(std::max(buffers_.size(), threads));
+
+		workers::split(fetch, count, threads);
+	}
+
+	char **getargv(const Proc *proc)
+	{
+		const Cmdline &cmdline(cmdlines_[proc - &procs_[0]]);
+		ssize_t size(cmdline.size_ == Unfetched ? this->cmdline(proc, buffer_) : cmdline.size_);
+
+		// an empty command line may have left its worker's buffer empty
+		if (size <= 0)
+			return NULL;
+
+		char *args(cmdline.size_ == Unfetched ? &buffer_[0] : &buffers_[cmdline.worker_][cmdline.offset_]);
+
+		argv_.clear();
+
+		for (char *arg(args), *end(arg + size); arg < end; arg += std::strlen(arg) + 1)
+			argv_.push_back(arg);
+
+		argv_.push_back(NULL);
+
+		return &argv_[0];
+	}
+
+	inline char *geterr() { return error_; }
+
+	~Table()
+	{
+		if (proc_ != -1)
+			close(proc_);
+	}
+
+private:
+	static ssize_t read(int fd, std::vector<char> &buffer)
+	{
+		ssize_t size;
+
+		while ((size = pread(fd, &buffer[0], buffer.size() - 1, 0)) == static_cast<ssize_t>(buffer.size() - 1))
+			buffer.resize(buffer.size() * 2);
+
+		if (size != -1)
+			buffer[size] = '\0';
+
+		return size;
+	}
+
+	ssize_t cmdline(const Proc *proc, std::vector<char> &buffer) const
+	{
+		char path[32];
+
+		std::snprintf(path, sizeof (path), "%d/cmdline", proc->pid_);
+
+		int fd(openat(proc_, path, O_RDONLY));
+
+		if (fd == -1)
+			return -1;
+
+		ssize_t size(read(fd, buffer));
+
+		close(fd);
+
+		return size;
+	}
+
+	// processes that exit between readdir() and here are silently skipped
+	bool stat(pid_t pid, Proc &proc, std::vector<char> &buffer) const
+	{
+		char path[32];
+
+		std::snprintf(path, sizeof (path), "%d/stat", pid);
+
+		int fd(openat(proc_, path, O_RDONLY));
+
+		if (fd == -1)
+			return false;
+
+		bool success(read(fd, buffer) > 0);
+
+		close(fd);
+
+		if (!success)
+			return false;
+
+		char *open(std::strchr(&buffer[0], '(')), *close(std::strrchr(&buffer[0], ')'));
+		unsigned flags;
+		unsigned long long user, system;
+
+		// the start time, in clock ticks since boot, tells a process from
+		// a later one that was given the same pid
+		if (!open || !close || std::sscanf(close + 1, " %*c %d %*d %*d %*d %*d %u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %u %*d %llu %*u %llu", &proc.ppid_, &flags, &user, &system, &proc.threads_, &proc.start_, &proc.rss_) != 7)
+			return false;
+
+		proc.rss_ *= page_;
+		proc.cpu_ = (user + system) * 1000000 / tick_;
+
+		size_t size(std::min<size_t>(close - open - 1, sizeof (proc.comm_) - 1));
+
+		std::memcpy(proc.comm_, open + 1, size);
+
+		proc.comm_[size] = '\0';
+		proc.pid_ = pid;
+
+		// kernel threads hang off of kthreadd, but present them like the BSDs do
+		if (flags & KernelThread)
+			proc.ppid_ = 0;
+
+		return uid(proc, buffer);
+	}
+
+	bool uid(Proc &proc, std::vector<char> &buffer) const
+	{
+		char path[32];
+
+		std::snprintf(path, sizeof (path), "%d/status", proc.pid_);
+
+		int fd(openat(proc_, path, O_RDONLY));
+
+		if (fd == -1)
+			return false;
+
+		bool success(read(fd, buffer) > 0);
+
+		close(fd);
+
+		if (!success)
+			return false;
+
+		// the first of the four ids on this line is the real one
+		char *line(std::strstr(&buffer[0], "\nUid:"));
+
+		return line && std::sscanf(line, "\nUid: %u", &proc.ruid_) == 1;
+	}
+};
+
+}
+
+typedef proc::Table kvm_t;
+
+inline kvm_t *kvm_openfiles(const char *, const char *, const char *, int, char *error)
+{
+	kvm_t *kd(new kvm_t);
+
+	if (!kd->open(error))
+	{
+		delete kd;
+
+		return NULL;
+	}
+
+	return kd;
+}
+
+inline char *kvm_geterr(kvm_t *kd)
+{
+	return kd->geterr();
+}
+#endif
 
 namespace kvm
 {
 
+#ifndef HAVE_PROCFS
 #if HAVE_DECL_KERN_PROC_PROC
 const int All(KERN_PROC_PROC);
 #elif HAVE_DECL_KERN_PROC_KTHREAD
@@ -73,6 +489,7 @@ const int All(KERN_PROC_KTHREAD);
 #else
 const int All(KERN_PROC_ALL);
 #endif
+#endif
 
 template <typename Type>
 inline Type *getprocs(kvm_t *kd, int &count);
@@ -92,6 +509,83 @@ inline uid_t ruid(Type *proc);
 template <typename Type>
 inline char *comm(Type *proc);
 
+template <typename Type>
+inline uint64_t start(Type *proc);
+
+template <typename Type>
+inline uint64_t rss(Type *proc);
+
+template <typename Type>
+inline uint64_t cpu(Type *proc);
+
+template <typename Type>
+inline unsigned threads(Type *proc);
+
+#ifdef HAVE_PROCFS
+typedef proc::Proc Proc;
+
+const int Flags(O_RDONLY);
+
+template <>
+inline proc::Proc *getprocs(kvm_t *kd, int &count)
+{
+	return kd->getprocs(count);
+}
+
+template <>
+inline char **getargv(kvm_t *kd, const proc::Proc *proc)
+{
+	return kd->getargv(proc);
+}
+
+template <>
+inline pid_t pid(Proc *proc)
+{
+	return proc->pid_;
+}
+
+template <>
+inline pid_t ppid(Proc *proc)
+{
+	return proc->ppid_;
+}
+
+template <>
+inline uid_t ruid(Proc *proc)
+{
+	return proc->ruid_;
+}
+
+template <>
+inline char *comm(Proc *proc)
+{
+	return proc->comm_;
+}
+
+template <>
+inline uint64_t start(Proc *proc)
+{
+	return proc->start_;
+}
+
+template <>
+inline uint64_t rss(Proc *proc)
+{
+	return proc->rss_;
+}
+
+template <>
+inline uint64_t cpu(Proc *proc)
+{
+	return proc->cpu_;
+}
+
+template <>
+inline unsigned threads(Proc *proc)
+{
+	return proc->threads_;
+}
+#else
 #ifndef HAVE_STRUCT_KINFO_PROC2
 #ifdef HAVE_KINFO_NEWABI
 typedef kinfo_proc Proc;
@@ -192,7 +686,163 @@ inline char *comm(Proc *proc)
 #	endif
 }
 
-}
+// in microseconds, or zero where the start time is not available
+template <>
+inline uint64_t start(Proc *proc)
+{
+#	ifdef HAVE_STRUCT_KINFO_PROCX_KI_START
+	return static_cast<uint64_t>(proc->ki_start.tv_sec) * 1000000 + proc->ki_start.tv_usec;
+#	elif defined(HAVE_STRUCT_KINFO_PROCX_KP_START)
+	return static_cast<uint64_t>(proc->kp_start.tv_sec) * 1000000 + proc->kp_start.tv_usec;
+#	elif defined(HAVE_STRUCT_KINFO_PROCX_P_USTART_SEC)
+	return static_cast<uint64_t>(proc->p_ustart_sec) * 1000000 + proc->p_ustart_usec;
+#	else
+	return 0;
+#	endif
+}
+
+// in bytes, or zero where it is not available
+template <>
+inline uint64_t rss(Proc *proc)
+{
+#	ifdef HAVE_STRUCT_KINFO_PROCX_KI_RSSIZE
+	return static_cast<uint64_t>(proc->ki_rssize) * sysconf(_SC_PAGESIZE);
+#	elif defined(HAVE_STRUCT_KINFO_PROCX_KP_VM_RSSIZE)
+	return static_cast<uint64_t>(proc->kp_vm_rssize) * sysconf(_SC_PAGESIZE);
+#	elif defined(HAVE_STRUCT_KINFO_PROCX_P_VM_RSSIZE)
+	return static_cast<uint64_t>(proc->p_vm_rssize) * sysconf(_SC_PAGESIZE);
+#	else
+	return 0;
+#	endif
+}
+
+// user and system time in microseconds, or zero where it is not available
+template <>
+inline uint64_t cpu(Proc *proc)
+{
+#	ifdef HAVE_STRUCT_KINFO_PROCX_KI_RUNTIME
+	return proc->ki_runtime;
+#	elif defined(HAVE_STRUCT_KINFO_PROCX_KP_RU)
+	return static_cast<uint64_t>(proc->kp_ru.ru_utime.tv_sec + proc->kp_ru.ru_stime.tv_sec) * 1000000 + proc->kp_ru.ru_utime.tv_usec + proc->kp_ru.ru_stime.tv_usec;
+#	elif defined(HAVE_STRUCT_KINFO_PROCX_P_RTIME_SEC)
+	return static_cast<uint64_t>(proc->p_rtime_sec) * 1000000 + proc->p_rtime_usec;
+#	else
+	return 0;
+#	endif
+}
+
+// one where the number of threads is not available
+template <>
+inline unsigned threads(Proc *proc)
+{
+#	ifdef HAVE_STRUCT_KINFO_PROCX_KI_NUMTHREADS
+	return proc->ki_numthreads;
+#	elif defined(HAVE_STRUCT_KINFO_PROCX_KP_NTHREADS)
+	return proc->kp_nthreads;
+#	elif defined(HAVE_STRUCT_KINFO_PROCX_P_NLWPS)
+	return proc->p_nlwps;
+#	else
+	return 1;
+#	endif
+}
+#endif
+
+template <>
+inline char **getargv(kvm_t *, const snapshot::Proc *proc)
+{
+	static std::vector<char *> argv;
+
+	if (!proc->argc_)
+		return NULL;
+
+	argv.clear();
+
+	char *arg(proc->string(proc->argv_));
+
+	_repeat (proc->argc_)
+	{
+		argv.push_back(arg);
+
+		arg += std::strlen(arg) + 1;
+	}
+
+	argv.push_back(NULL);
+
+	return &argv[0];
+}
+
+template <>
+inline pid_t pid(snapshot::Proc *proc)
+{
+	return proc->pid_;
+}
+
+template <>
+inline pid_t ppid(snapshot::Proc *proc)
+{
+	return proc->ppid_;
+}
+
+template <>
+inline uid_t ruid(snapshot::Proc *proc)
+{
+	return proc->ruid_;
+}
+
+template <>
+inline char *comm(snapshot::Proc *proc)
+{
+	return proc->string(proc->comm_);
+}
+
+template <>
+inline uint64_t start(snapshot::Proc *proc)
+{
+	return proc->start_;
+}
+
+template <>
+inline uint64_t rss(snapshot::Proc *proc)
+{
+	return proc->rss_;
+}
+
+template <>
+inline uint64_t cpu(snapshot::Proc *proc)
+{
+	return proc->cpu_;
+}
+
+template <>
+inline unsigned threads(snapshot::Proc *proc)
+{
+	return proc->threads_;
+}
+
+}
+
+namespace snapshot
+{
+
+template <typename Type>
+void save(const char *path, kvm_t *kd, Type *procs, int count)
+{
+	typedef Type *Pointer;
+	Writer writer;
+
+	writer.reserve(count);
+
+	_forall (Pointer, proc, procs, procs + count)
+	{
+		Proc record = { kvm::pid(proc), kvm::ppid(proc), kvm::ruid(proc), 0, 0, 0, kvm::threads(proc), 0, kvm::start(proc), kvm::rss(proc), kvm::cpu(proc) };
+
+		writer.add(record, kvm::comm(proc), kvm::getargv(kd, proc));
+	}
+
+	writer.write(path);
+}
+
+}
 
 enum Flags
 {
@@ -211,53 +861,207 @@ enum Flags
 	UidChanges	= 0x1000,
 	Unicode		= 0x2000,
 	Pid			= 0x4000,
-	User		= 0x8000
+	User		= 0x8000,
+	Stats		= 0x10000,
+	ShowParents	= 0x20000,
+	HighlightUser	= 0x40000,
+	Watch		= 0x80000,
+	ShowRss		= 0x100000,
+	ShowCpu		= 0x200000,
+	ShowThreads	= 0x400000,
+	RssSort		= 0x800000,
+	CpuSort		= 0x1000000,
+	CountSort	= 0x2000000,
+	Top			= 0x4000000,
+	RssTop		= 0x8000000,
+	CpuTop		= 0x10000000,
+	MaxDepth	= 0x20000000,
+	MaxLines	= 0x40000000
+};
+
+// wall clock and CPU time of each phase followed by the counters, written to
+// stderr as "NAME VALUE" lines so they can be fed straight to a script; the
+// counters are bumped whether anyone asked or not since an increment is
+// cheaper than checking
+class Statistics
+{
+public:
+	enum Counter { Procs, Names, Linked, Cycles, Comparisons, Argv, Written, Allocations, Counters };
+
+private:
+	struct Phase
+	{
+		const char *name_;
+		double wall_, cpu_;
+	};
+
+	static size_t counters_[Counters];
+
+	bool enabled_;
+	Phase start_, mark_;
+	std::vector<Phase> phases_;
+
+	static double wall()
+	{
+		timespec time;
+
+		if (clock_gettime(CLOCK_MONOTONIC, &time))
+			err(1, NULL);
+
+		return time.tv_sec + time.tv_nsec / 1e9;
+	}
+
+	static double cpu()
+	{
+		rusage usage;
+
+		if (getrusage(RUSAGE_SELF, &usage))
+			err(1, NULL);
+
+		return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+	}
+
+	void now(Phase &phase, const char *name)
+	{
+		phase.name_ = name;
+		phase.wall_ = wall();
+		phase.cpu_ = cpu();
+	}
+
+public:
+	Statistics(bool enabled) : enabled_(enabled)
+	{
+		if (enabled_)
+		{
+			now(start_, "total");
+
+			mark_ = start_;
+		}
+	}
+
+	static inline void count(Counter counter, size_t value = 1)
+	{
+		counters_[counter] += value;
+	}
+
+	// ends the phase that started at the previous call (or construction)
+	void phase(const char *name)
+	{
+		if (!enabled_)
+			return;
+
+		Phase mark;
+
+		now(mark, name);
+
+		Phase phase = { name, mark.wall_ - mark_.wall_, mark.cpu_ - mark_.cpu_ };
+
+		phases_.push_back(phase);
+
+		mark_ = mark;
+	}
+
+	void print() const
+	{
+		if (!enabled_)
+			return;
+
+		static const char *names[Counters] = { "procs", "names", "linked", "cycles", "comparisons", "argv", "written", "allocations" };
+		Phase total = { "total", mark_.wall_ - start_.wall_, mark_.cpu_ - start_.cpu_ };
+
+		_foreach (const std::vector<Phase>, phase, phases_)
+			std::fprintf(stderr, "%s.wall %.6f\n%s.cpu %.6f\n", phase->name_, phase->wall_, phase->name_, phase->cpu_);
+
+		std::fprintf(stderr, "%s.wall %.6f\n%s.cpu %.6f\n", total.name_, total.wall_, total.name_, total.cpu_);
+
+		_repeat (Counters)
+			std::fprintf(stderr, "%s %lu\n", names[_index], static_cast<unsigned long>(counters_[_index]));
+	}
 };
 
+size_t Statistics::counters_[Statistics::Counters];
+
 enum Escape { None, BoxDrawing, Bright };
 
+// all of it to stdout, however many writes that takes
+static void output(const std::string &data)
+{
+	for (const char *next(data.data()), *end(next + data.size()); next != end;)
+	{
+		ssize_t size(write(1, next, end - next));
+
+		if (size == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			err(1, NULL);
+		}
+
+		next += size;
+	}
+}
+
+// the height of the terminal on standard output
+static size_t rows()
+{
+	winsize size;
+
+	if (ioctl(1, TIOCGWINSZ, &size) == -1 || !size.ws_row)
+		return 24;
+
+	return size.ws_row;
+}
+
 struct Segment
 {
-	size_t width_;
+	size_t offset_, size_, width_;
 	Escape escape_;
-	char *string_;
 
-	inline Segment(size_t width, Escape escape, char *string) : width_(width), escape_(escape), string_(string) {}
+	inline Segment(size_t offset, size_t size, size_t width, Escape escape) : offset_(offset), size_(size), width_(width), escape_(escape) {}
 };
 
 struct Branch
 {
-	std::string indentation_;
+	size_t indentation_;
 	bool done_;
 
-	inline Branch(size_t indentation) : indentation_(indentation, ' '), done_(false) {}
+	inline Branch(size_t indentation) : indentation_(indentation), done_(false) {}
 };
 
 class Tree
 {
-	const uint16_t &flags_;
+	enum { Flush = 64 * 1024 };
+
+	const uint32_t &flags_;
 	bool vt100_;
-	wchar_t horizontal_, vertical_, upAndRight_, verticalAndRight_, downAndHorizontal_;
+	std::string horizontal_, vertical_, upAndRight_, verticalAndRight_, downAndHorizontal_;
 	size_t maxWidth_, width_;
 	bool max_, suppress_;
+	std::string line_, output_;
 	std::vector<Segment> segments_;
 	std::vector<Branch> branches_;
 	bool first_, last_;
 	size_t duplicate_;
+	std::string *capture_;
+	size_t lines_, budget_;
+	bool part_;
 
 public:
-	Tree(const uint16_t &flags) : flags_(flags), vt100_(false), maxWidth_(0), width_(0), max_(false), suppress_(false), duplicate_(0)
+	// with capture everything drawn is appended there instead of written;
+	// with a budget, full() says when that many lines have been drawn
+	Tree(const uint32_t &flags, std::string *capture = NULL, size_t budget = 0) : flags_(flags), vt100_(false), maxWidth_(0), width_(0), max_(false), suppress_(false), duplicate_(0), capture_(capture), lines_(0), budget_(budget), part_(false)
 	{
 		bool tty(isatty(1));
 
 		if (flags & Ascii)
 		{
 		ascii:
-			horizontal_ = L'-';
-			vertical_ = L'|';
-			upAndRight_ = L'`';
-			verticalAndRight_ = L'|';
-			downAndHorizontal_ = L'+';
+			horizontal_ = "-";
+			vertical_ = "|";
+			upAndRight_ = "`";
+			verticalAndRight_ = "|";
+			downAndHorizontal_ = "+";
 		}
 		else if (flags & Unicode)
 		{
@@ -265,13 +1069,8 @@ public:
 			if (!std::setlocale(LC_CTYPE, ""))
 				goto vt100;
 
-			horizontal_ = L'\x2500';
-			vertical_ = L'\x2502';
-			upAndRight_ = L'\x2514';
-			verticalAndRight_ = L'\x251c';
-			downAndHorizontal_ = L'\x252c';
-
-			wchar_t wides[] = { horizontal_, vertical_, upAndRight_, verticalAndRight_, downAndHorizontal_ };
+			wchar_t wides[] = { L'\x2500', L'\x2502', L'\x2514', L'\x251c', L'\x252c' };
+			std::string *encodings[] = { &horizontal_, &vertical_, &upAndRight_, &verticalAndRight_, &downAndHorizontal_ };
 			char *buffer = new char[MB_CUR_MAX];
 
 			for (int index(0); index != sizeof (wides) / sizeof (*wides); ++index)
@@ -297,6 +1096,8 @@ public:
 					delete [] buffer;
 					goto vt100;
 				}
+
+				encodings[index]->assign(buffer, size);
 			}
 
 			delete [] buffer;
@@ -305,11 +1106,11 @@ public:
 		{
 		vt100:
 			vt100_ = true;
-			horizontal_ = L'\x71';
-			vertical_ = L'\x78';
-			upAndRight_ = L'\x6d';
-			verticalAndRight_ = L'\x74';
-			downAndHorizontal_ = L'\x77';
+			horizontal_ = "\x71";
+			vertical_ = "\x78";
+			upAndRight_ = "\x6d";
+			verticalAndRight_ = "\x74";
+			downAndHorizontal_ = "\x77";
 		}
 		else if (tty)
 			goto unicode;
@@ -327,6 +1128,9 @@ public:
 
 				if (tigetflag(const_cast<char *>("am")) && !tigetflag(const_cast<char *>("xenl")))
 					suppress_ = true;
+
+				// --watch sets up a new one for every refresh
+				del_curterm(cur_term);
 			}
 #			else
 			char buffer[1024], *term(std::getenv("TERM"));
@@ -342,9 +1146,28 @@ public:
 			else
 				maxWidth_ = 80;
 		}
+
+		// the --watch screen splits what is captured into lines by itself,
+		// so a line the whole width of the terminal still needs its newline
+		if (capture_)
+			suppress_ = false;
+
+		output_.reserve(Flush * 2);
+	}
+
+	// drawn like tree into part, which can be done on another thread and
+	// then append()ed to tree; only the whole tree counts what is written
+	Tree(const Tree &tree, std::string &part) : flags_(tree.flags_), vt100_(tree.vt100_), horizontal_(tree.horizontal_), vertical_(tree.vertical_), upAndRight_(tree.upAndRight_), verticalAndRight_(tree.verticalAndRight_), downAndHorizontal_(tree.downAndHorizontal_), maxWidth_(tree.maxWidth_), width_(0), max_(false), suppress_(tree.suppress_), duplicate_(0), capture_(&part), lines_(0), budget_(0), part_(true)
+	{
+		output_.reserve(Flush * 2);
+	}
+
+	~Tree()
+	{
+		flush();
 	}
 
-	void print(const std::string &string, bool highlight, size_t duplicate)
+	void print(const char *string, bool highlight, size_t duplicate)
 	{
 		Escape escape(vt100_ ? BoxDrawing : None);
 
@@ -354,72 +1177,99 @@ public:
 
 			_foreach (std::vector<Branch>, branch, branches_)
 			{
-				size_t width(branch->indentation_.size() + 2);
+				const std::string *line, *next;
 
 				if (_index == last)
 				{
-					wchar_t line;
-
 					if (last_)
 					{
 						branch->done_ = true;
-						line = upAndRight_;
+						line = &upAndRight_;
 					}
 					else
-						line = verticalAndRight_;
+						line = &verticalAndRight_;
 
-					print(width, escape, "%s%lc%lc", branch->indentation_.c_str(), line, horizontal_);
+					next = &horizontal_;
 				}
 				else
-					print(width, escape, "%s%lc ", branch->indentation_.c_str(), branch->done_ ? ' ' : vertical_);
+				{
+					static const std::string space(" ");
+
+					line = branch->done_ ? &space : &vertical_;
+					next = &space;
+				}
+
+				if (max_)
+					continue;
+
+				line_.append(branch->indentation_, ' ');
+				line_ += *line;
+				line_ += *next;
+
+				segment(branch->indentation_ + 2, escape);
 			}
 		}
 		else if (branches_.size())
 		{
-			wchar_t line;
+			const std::string *line;
 
 			if (last_)
 			{
 				branches_.back().done_ = true;
-				line = horizontal_;
+				line = &horizontal_;
 			}
 			else
-				line = downAndHorizontal_;
+				line = &downAndHorizontal_;
 
-			print(3, escape, "%lc%lc%lc", horizontal_, line, horizontal_);
+			if (!max_)
+			{
+				line_ += horizontal_;
+				line_ += *line;
+				line_ += horizontal_;
+
+				segment(3, escape);
+			}
 		}
 
 		size_t size(0);
 
 		if (duplicate)
 		{
-			std::ostringstream string;
+			char count[sizeof (size_t) * 3 + 3];
 
-			string << duplicate << "*[";
+			size = std::sprintf(count, "%lu*[", static_cast<unsigned long>(duplicate));
 
-			size = string.str().size();
+			if (!max_)
+			{
+				line_.append(count, size);
 
-			print(size, None, "%s", string.str().c_str());
+				segment(size, None);
+			}
 
 			++duplicate_;
 		}
 
-		print(string.size(), highlight ? Bright : None, "%s", string.c_str());
+		size_t length(std::strlen(string));
+
+		if (!max_)
+		{
+			line_.append(string, length);
+
+			segment(length, highlight ? Bright : None);
+		}
 
-		branches_.push_back(Branch(!(flags_ & Arguments) ? size + string.size() + 1 : 2));
+		branches_.push_back(Branch(!(flags_ & Arguments) ? size + length + 1 : 2));
 	}
 
-	inline void printArg(const std::string &arg, bool last)
+	inline void printArg(const char *arg, bool last)
 	{
 		if (max_)
 			return;
 
-		size_t width(arg.size() + 1);
+		size_t length(std::strlen(arg)), width(length + 1);
 
 		width_ += width;
 
-		char *string;
-
 		if (maxWidth_ && !(flags_ & Long))
 			if (width_ > maxWidth_ || !last && width_ + 3 >= maxWidth_)
 			{
@@ -432,21 +1282,24 @@ public:
 				if (size < -3)
 					return;
 				else if (size < 1)
+					line_.append(" ...", size + 4);
+				else
 				{
-					string = static_cast<char *>(std::malloc(size += 5));
-
-					snprintf(string, size, " ...");
+					line_ += ' ';
+					line_.append(arg, size);
+					line_ += "...";
 				}
-				else
-					asprintf(&string, " %s...", arg.substr(0, size).c_str());
 			}
 			else
 				goto print;
 		else
+		{
 		print:
-			asprintf(&string, " %s", arg.c_str());
+			line_ += ' ';
+			line_.append(arg, length);
+		}
 
-		segments_.push_back(Segment(width, None, string));
+		segments_.push_back(Segment(start(), line_.size() - start(), width, None));
 	}
 
 	inline void pop(bool children)
@@ -461,7 +1314,12 @@ public:
 	{
 		if (duplicate_)
 		{
-			print(duplicate_, None, "%s", std::string(duplicate_, ']').c_str());
+			if (!max_)
+			{
+				line_.append(duplicate_, ']');
+
+				segment(duplicate_, None);
+			}
 
 			duplicate_ = 0;
 		}
@@ -470,37 +1328,63 @@ public:
 
 		_foreach (std::vector<Segment>, segment, segments_)
 		{
-			const char *begin, *end;
-
 			switch (segment->escape_)
 			{
 			case BoxDrawing:
-				begin = !_index || (segment - 1)->escape_ != BoxDrawing ? "\033(0\017" : "";
-				end = _index == last || (segment + 1)->escape_ != BoxDrawing ? "\033(B\017" : "";
+				if (!_index || (segment - 1)->escape_ != BoxDrawing)
+					output_ += "\033(0\017";
+
+				output_.append(line_, segment->offset_, segment->size_);
+
+				if (_index == last || (segment + 1)->escape_ != BoxDrawing)
+					output_ += "\033(B\017";
+
 				break;
 			case Bright:
-				begin = "\033[1m";
-				end = "\033[22m";
+				output_ += "\033[1m";
+				output_.append(line_, segment->offset_, segment->size_);
+				output_ += "\033[22m";
+
 				break;
 			default:
-				begin = end = ""; break;
+				output_.append(line_, segment->offset_, segment->size_);
 			}
-
-			std::printf("%s%s%s", begin, segment->string_, end);
-			std::free(segment->string_);
 		}
 
 		segments_.clear();
+		line_.clear();
 
-		if (suppress_ && width_ == maxWidth_)
-			std::fflush(stdout);
-		else
-			std::printf("\n");
+		if (!suppress_ || width_ != maxWidth_)
+			output_ += '\n';
+
+		if (output_.size() >= Flush)
+			flush();
+
+		++lines_;
 
 		width_ = 0;
 		max_ = false;
 	}
 
+	void append(const std::string &part)
+	{
+		output_ += part;
+
+		if (output_.size() >= Flush)
+			flush();
+	}
+
+	// only ever true between lines
+	inline bool full() const { return budget_ && lines_ >= budget_; }
+
+	// a last line saying how many processes were left out
+	void omit(size_t count)
+	{
+		char line[64];
+
+		output_.append(line, std::sprintf(line, "... %lu more process%s\n", static_cast<unsigned long>(count), count == 1 ? "" : "es"));
+	}
+
 	inline Tree &operator()(bool first, bool last)
 	{
 		first_ = first;
@@ -510,19 +1394,15 @@ public:
 	}
 
 private:
-	void print(size_t width, Escape escape, const char * format, ...)
+	inline size_t start() const
 	{
-		if (max_)
-			return;
-
-		std::va_list args;
-
-		va_start(args, format);
-
-		char *string;
+		return segments_.empty() ? 0 : segments_.back().offset_ + segments_.back().size_;
+	}
 
-		vasprintf(&string, format, args);
-		va_end(args);
+	// close off whatever has been appended to line_ since the last segment
+	void segment(size_t width, Escape escape)
+	{
+		Segment segment(start(), line_.size() - start(), width, escape);
 
 		width_ += width;
 
@@ -533,437 +1413,1936 @@ private:
 				width_ = maxWidth_;
 				max_ = true;
 
-				bool previous = !width;
-
-				if (previous)
+				if (!width)
 				{
-					std::free(string);
+					line_.resize(segment.offset_);
+					truncate(segments_.back(), segments_.back().width_);
 
-					const Segment &segment(segments_.back());
-
-					width = segment.width_;
-					string = segment.string_;
+					return;
 				}
 
-				std::wstring wide(width - 1, '\0');
+				truncate(segment, width);
+			}
+
+		segments_.push_back(segment);
+	}
+
+	// keep the first width - 1 characters of the last segment and mark the
+	// cut with a plus
+	void truncate(Segment &segment, size_t width)
+	{
+		size_t size(0);
+		std::mbstate_t state = std::mbstate_t();
 
-				std::mbstowcs(const_cast<wchar_t *>(wide.data()), string, wide.size());
-				std::free(string);
+		for (size_t count(1); count < width && size < segment.size_; ++count)
+		{
+			size_t length(std::mbrlen(line_.data() + segment.offset_ + size, segment.size_ - size, &state));
 
-				wide += L'+';
+			if (length == static_cast<size_t>(-1) || length == static_cast<size_t>(-2))
+			{
+				state = std::mbstate_t();
+				length = 1;
+			}
 
-				size_t size(std::wcstombs(NULL, wide.c_str(), 0) + 1);
+			size += length ? length : 1;
+		}
 
-				string = static_cast<char *>(std::malloc(size));
+		line_.resize(segment.offset_ + size);
 
-				std::wcstombs(string, wide.c_str(), size);
+		line_ += '+';
+		segment.size_ = size + 1;
+		segment.width_ = width;
+	}
 
-				if (previous)
-				{
-					segments_.back().string_ = string;
+	void flush()
+	{
+		if (!part_)
+			Statistics::count(Statistics::Written, output_.size());
 
-					return;
-				}
-			}
+		if (capture_)
+			capture_->append(output_);
+		else
+			::output(output_);
 
-		segments_.push_back(Segment(width, escape, string));
+		output_.clear();
 	}
 };
 
-template <typename Type>
-struct Proc
+class Arena
 {
-	typedef std::multimap<pid_t, Proc<Type> *> PidMap;
-	typedef std::multimap<std::string, Proc<Type> *> NameMap;
+	enum { Alignment = sizeof (void *), Block = 256 * 1024 };
 
-private:
-	const uint16_t &flags_;
-	kvm_t *kd_;
-	Type *proc_;
-	mutable std::string name_, print_;
-	Proc<Type> *parent_;
-	PidMap childrenByPid_;
-	NameMap childrenByName_;
-	bool highlight_, root_;
-	int8_t compact_;
-	size_t duplicate_;
+	std::vector<char *> blocks_;
+	char *next_, *end_;
+	size_t allocations_;
+
+	static inline size_t align(size_t size) { return (size + Alignment - 1) & ~static_cast<size_t>(Alignment - 1); }
 
 public:
-	inline Proc(const uint16_t &flags, kvm_t *kd, Type *proc) : flags_(flags), kd_(kd), proc_(proc), parent_(NULL), highlight_(false), root_(false), compact_(-1), duplicate_(0) {}
+	Arena() : next_(NULL), end_(NULL), allocations_(0) {}
 
-	inline const std::string &name() const
+	// counted here rather than as they happen since an arena can belong to
+	// another thread until then
+	~Arena()
 	{
-		if (name_.empty())
-			name_ = visual(kvm::comm(proc_));
+		Statistics::count(Statistics::Allocations, allocations_);
 
-		return name_;
+		_foreach (std::vector<char *>, block, blocks_)
+			std::free(*block);
 	}
 
-	inline pid_t parent() const { return kvm::ppid(proc_); }
-	inline pid_t pid() const { return kvm::pid(proc_); }
-
-	inline void child(Proc *proc)
+	void *allocate(size_t size)
 	{
-		if (proc == this)
-			return;
+		++allocations_;
 
-		proc->parent_ = this;
+		size = align(size);
 
-		childrenByPid_.insert(typename PidMap::value_type(proc->pid(), proc));
-		childrenByName_.insert(typename NameMap::value_type(proc->name(), proc));
-	}
+		if (size > static_cast<size_t>(end_ - next_))
+		{
+			size_t block(std::max<size_t>(size, Block));
 
-	inline void highlight()
-	{
-		highlight_ = true;
+			if (!(next_ = static_cast<char *>(std::malloc(block))))
+				err(1, NULL);
 
-		if (parent_)
-			parent_->highlight();
-	}
+			blocks_.push_back(next_);
 
-	inline bool compact()
-	{
-		if (compact_ == -1)
-			compact_ = compact(childrenByName_);
+			end_ = next_ + block;
+		}
+
+		char *memory(next_);
+
+		next_ += size;
 
-		return compact_;
+		return memory;
 	}
 
-	bool root(uid_t uid)
+	// give back the unused tail of the most recent allocation
+	inline void shrink(void *memory, size_t size)
 	{
-		if (flags_ & User)
-		{
-			if (uid == this->uid())
-			{
-				Proc *parent(parent_);
-
-				while (parent)
-				{
-					if (parent->uid() == uid)
-						return false;
+		next_ = static_cast<char *>(memory) + align(size);
+	}
 
-					parent = parent->parent_;
-				}
+	char *strdup(const char *string, size_t size)
+	{
+		char *copy(static_cast<char *>(allocate(size + 1)));
 
-				return root_ = true;
-			}
+		std::memcpy(copy, string, size);
 
-			return false;
-		}
+		copy[size] = '\0';
 
-		return root_ = !parent_;
+		return copy;
 	}
 
-	inline void printByPid(Tree &tree) const
+	inline char *strdup(const char *string) { return strdup(string, std::strlen(string)); }
+};
+
+inline void *operator new(size_t size, Arena &arena)
+{
+	return arena.allocate(size);
+}
+
+// a copy of string that is safe to print, with anything unprintable escaped
+static const char *visual(Arena &arena, const char *string)
+{
+	char *visual(static_cast<char *>(arena.allocate(std::strlen(string) * 4 + 1)));
+
+	arena.shrink(visual, strvis(visual, string, VIS_TAB | VIS_NL | VIS_NOSLASH) + 1);
+
+	return visual;
+}
+
+// every distinct command name made visual once and given a rank among the
+// others, so that processes sort by a number and a shared name can be told
+// from the pointer to it
+class Names
+{
+public:
+	struct Name
 	{
-		print(tree, childrenByPid_);
-	}
+		const char *comm_, *visual_;
+		size_t hash_, rank_;
+		Name *next_;
+
+		// what --glob or --regex made of the visual form, once asked
+		mutable enum { Untried, Matched, Unmatched } match_;
+	};
+
+private:
+	Arena &arena_;
+	std::vector<Name *> buckets_, names_;
+
+public:
+	Names(Arena &arena) : arena_(arena), buckets_(64) {}
 
-	inline void printByName(Tree &tree) const
+	static inline size_t hash(const char *string)
 	{
-		print(tree, childrenByName_);
+		size_t hash(2166136261U);
+
+		for (; *string; ++string)
+			hash = (hash ^ static_cast<unsigned char>(*string)) * 16777619U;
+
+		return hash;
 	}
 
-	static bool compact(NameMap &names)
+	// one that is not in the table, ranked first, for a line with no
+	// process behind it
+	static const Name *label(Arena &arena, const char *label)
 	{
-		Proc *previous(NULL);
-		bool compact(true);
+		Name *name(new (arena) Name), value = { label, label, hash(label), 0, NULL, Name::Untried };
 
-		_tforeach (NameMap, name, names)
-		{
-			Proc *proc(name->second);
-
-			if (proc->duplicate_)
-				continue;
+		*name = value;
 
-			size_t duplicate(proc->compact());
+		return name;
+	}
 
-			if (compact && duplicate && (!previous || proc->print() == previous->print()))
-				previous = proc;
-			else
-				compact = false;
+	// only ranked once rank() has been called
+	const Name *operator()(const char *comm)
+	{
+		size_t hash(this->hash(comm));
 
-			size_t count(names.count(name->first));
+		for (Name *name(buckets_[hash & (buckets_.size() - 1)]); name; name = name->next_)
+			if (name->hash_ == hash && !std::strcmp(name->comm_, comm))
+				return name;
 
-			if (!duplicate || count == 1)
-				continue;
+		if (names_.size() == buckets_.size())
+		{
+			buckets_.assign(buckets_.size() * 2, NULL);
 
-			_forall(typename NameMap::iterator, n4me, (++name)--, names.upper_bound(name->first))
+			_tforeach (std::vector<Name *>, name, names_)
 			{
-				Proc *pr0c(n4me->second);
+				Name *&bucket(buckets_[(*name)->hash_ & (buckets_.size() - 1)]);
 
-				if (pr0c->compact() && Proc::compact(proc, pr0c))
-					duplicate += ++pr0c->duplicate_;
+				(*name)->next_ = bucket;
+				bucket = *name;
 			}
-
-			if (duplicate != 1)
-				proc->duplicate_ = duplicate;
 		}
 
-		return compact;
+		Name *&bucket(buckets_[hash & (buckets_.size() - 1)]);
+		Name *name(new (arena_) Name), value = { comm, NULL, hash, 0, bucket, Name::Untried };
+
+		*name = value;
+
+		names_.push_back(bucket = name);
+
+		return name;
 	}
 
-private:
-	inline std::string visual(const char *string) const
+	// in the order of their visual forms, where names that look the same
+	// share a rank; the hash is of the visual form from then on
+	void rank()
 	{
-		std::string visual(std::strlen(string) * 4 + 1, '\0');
+		Statistics::count(Statistics::Names, names_.size());
+
+		_tforeach (std::vector<Name *>, name, names_)
+		{
+			(*name)->visual_ = visual(arena_, (*name)->comm_);
+			(*name)->hash_ = hash((*name)->visual_);
+		}
+
+		std::sort(names_.begin(), names_.end(), Less());
 
-		visual.resize(strvis(const_cast<char *>(visual.data()), string, VIS_TAB | VIS_NL | VIS_NOSLASH));
+		size_t rank(0);
+
+		_tforeach (std::vector<Name *>, name, names_)
+		{
+			if (_index && std::strcmp((*(name - 1))->visual_, (*name)->visual_))
+				++rank;
 
-		return visual;
+			(*name)->rank_ = rank;
+		}
 	}
 
-	template <typename Map>
-	void print(Tree &tree, const Map &children) const
+private:
+	struct Less
 	{
-		if (duplicate_ == 1)
-			return;
+		inline bool operator()(const Name *one, const Name *two) const { return std::strcmp(one->visual_, two->visual_) < 0; }
+	};
+};
 
-		print(tree);
+// user names by uid, each looked up at most once; a uid without a passwd
+// entry is shown as the number
+class Users
+{
+	// past this many uids one pass over the whole database beats asking
+	// for each of them
+	enum { Enumerate = 64 };
 
-		size_t size(children.size()), last(size - 1);
+	Arena &arena_;
+	std::map<uid_t, const char *> names_;
 
-		_tforeach (const Map, child, children)
-		{
-			Proc<Type> *proc(child->second);
-			bool l4st(_index + (proc->duplicate_ ? proc->duplicate_ - 1 : 0) == last);
+public:
+	Users(Arena &arena) : arena_(arena) {}
 
-			if (!l4st)
-			{
-				l4st = true;
+	const char *operator()(uid_t uid)
+	{
+		std::map<uid_t, const char *>::iterator name(names_.find(uid));
 
-				for (++child; child != _end; ++child)
-					if (child->second->duplicate_ != 1)
-					{
-						l4st = false;
+		if (name != names_.end())
+			return name->second;
 
-						break;
-					}
+		passwd *user(getpwuid(uid));
 
-				--child;
-			}
+		if (user)
+			return names_[uid] = arena_.strdup(user->pw_name);
 
-			proc->print(tree(!_index, l4st), proc->template children<Map>());
+		char number[32];
 
-			if (l4st)
-				break;
-		}
+		std::snprintf(number, sizeof (number), "%lu", static_cast<unsigned long>(uid));
 
-		tree.pop(size);
+		return names_[uid] = arena_.strdup(number);
 	}
 
-	void print(Tree &tree) const
+	// uids must be sorted and unique; anything the database does not list
+	// is left for operator() to look up on its own
+	void load(const std::vector<uid_t> &uids)
 	{
-		tree.print(print(), highlight_, duplicate_);
+		if (uids.size() <= Enumerate)
+			return;
 
-		if (flags_ & Arguments)
-		{
-			char **argv(kvm::getargv(kd_, proc_));
+		setpwent();
 
-			if (argv && *argv)
-				for (++argv; *argv; ++argv)
-					tree.printArg(visual(*argv), !*(argv + 1));
+		while (passwd *user = getpwent())
+			if (std::binary_search(uids.begin(), uids.end(), user->pw_uid) && !names_.count(user->pw_uid))
+				names_[user->pw_uid] = arena_.strdup(user->pw_name);
 
-			tree.done();
-		}
+		endpwent();
 	}
+};
+
+// every pid given to -H and friends, plus the uid for --highlight-user
+struct Highlights
+{
+	std::vector<pid_t> pids_;
+	uid_t uid_;
+
+	Highlights() : uid_(0) {}
+};
 
-	const std::string &print() const
+// how much of the tree to show, where zero is no limit
+struct Limits
+{
+	unsigned top_, depth_, lines_;
+
+	Limits() : top_(0), depth_(0), lines_(0) {}
+};
+
+// a --glob or --regex pattern, compiled once up front; however many
+// processes share a name it is only matched once
+class Matcher
+{
+	uint32_t flags_;
+	const char *pattern_;
+	regex_t regex_;
+
+public:
+	Matcher(uint32_t flags, const char *pattern) : flags_(flags & (Glob | Regex)), pattern_(pattern)
 	{
-		if (print_.empty())
+		if (flags_ & Regex)
 		{
-			std::ostringstream print;
+			int error(regcomp(&regex_, pattern, REG_EXTENDED | REG_NOSUB));
 
-			if (flags_ & ShowTitles)
+			if (error)
 			{
-				char **argv(kvm::getargv(kd_, proc_));
+				char message[256];
 
-				if (argv)
-					print << visual(*argv);
-				else
-					print << name();
+				regerror(error, &regex_, message, sizeof (message));
+
+				errx(1, "%s: \"%s\"", message, pattern);
 			}
-			else
-				print << name();
+		}
+	}
 
-			bool p1d(flags_ & ShowPids), args(flags_ & Arguments);
-			bool change(flags_ & UidChanges && (root_ ? !(flags_ & User) && uid() : parent_ && uid() != parent_->uid()));
-			bool parens((p1d || change) && !args);
+	~Matcher()
+	{
+		if (flags_ & Regex)
+			regfree(&regex_);
+	}
 
-			if (parens)
-				print << '(';
+	inline bool operator!() const { return !flags_; }
 
-			if (p1d)
-			{
-				if (!parens)
-					print << ',';
+	// the answer is kept with the interned name, so each name is tried
+	// once for every table that --watch builds
+	bool operator()(const Names::Name *name) const
+	{
+		if (name->match_ == Names::Name::Untried)
+			name->match_ = (flags_ & Glob ? !fnmatch(pattern_, name->visual_, 0) : !regexec(&regex_, name->visual_, 0, NULL, 0)) ? Names::Name::Matched : Names::Name::Unmatched;
 
-				print << pid();
-			}
+		return name->match_ == Names::Name::Matched;
+	}
+};
 
-			if (change)
-			{
-				if (!parens || p1d)
-					print << ',';
+template <typename Value>
+class PidMap
+{
+public:
+	typedef std::pair<pid_t, Value> value_type;
+	typedef typename std::vector<value_type>::iterator iterator;
+	typedef typename std::vector<value_type>::const_iterator const_iterator;
 
-				passwd *user(getpwuid(uid()));
+private:
+	std::vector<value_type> values_;
+	std::vector<uint32_t> slots_;
+	unsigned shift_;
 
-				print << user->pw_name;
-			}
+	static inline bool less(const value_type &one, const value_type &two) { return one.first < two.first; }
 
-			if (parens)
-				print << ')';
+	inline uint32_t slot(pid_t pid) const { return static_cast<uint32_t>(pid) * 0x9e3779b1U >> shift_; }
 
-			print_ = print.str();
-		}
+public:
+	PidMap() : shift_(32) {}
 
-		return print_;
-	}
+	inline void reserve(size_t size) { values_.reserve(size); }
+	inline void insert(const value_type &value) { values_.push_back(value); }
 
-	inline uid_t uid() const { return kvm::ruid(proc_); }
+	// sort by pid and build the open addressing table; anything inserted
+	// afterward cannot be found until this is called again
+	void index()
+	{
+		std::stable_sort(values_.begin(), values_.end(), less);
 
-	template <typename Map>
-	inline const Map &children() const;
+		size_t size(2);
 
-	inline bool hasChildren() const { return childrenByName_.size(); }
-	inline Proc<Type> *child() const { return childrenByName_.begin()->second; }
+		for (shift_ = 31; size < values_.size() * 2; size <<= 1)
+			--shift_;
 
-	inline static bool compact(Proc<Type> *one, Proc<Type> *two)
-	{
-		if (one->print() != two->print())
-			return false;
+		slots_.assign(size, 0);
 
-		if (one->hasChildren() != two->hasChildren())
-			return false;
+		uint32_t mask(size - 1);
 
-		if (one->hasChildren() && !compact(one->child(), two->child()))
-			return false;
+		_tforeach (std::vector<value_type>, value, values_)
+		{
+			if (_index && (value - 1)->first == value->first)
+				continue;
 
-		if (two->highlight_)
-			one->highlight_ = true;
+			uint32_t slot(this->slot(value->first));
 
-		return true;
+			while (slots_[slot])
+				slot = (slot + 1) & mask;
+
+			slots_[slot] = _index + 1;
+		}
+	}
+
+	iterator find(pid_t pid)
+	{
+		if (slots_.empty())
+			return end();
+
+		uint32_t mask(slots_.size() - 1);
+
+		for (uint32_t slot(this->slot(pid)); slots_[slot]; slot = (slot + 1) & mask)
+			if (values_[slots_[slot] - 1].first == pid)
+				return values_.begin() + (slots_[slot] - 1);
+
+		return end();
 	}
+
+	inline iterator begin() { return values_.begin(); }
+	inline iterator end() { return values_.end(); }
+	inline const_iterator begin() const { return values_.begin(); }
+	inline const_iterator end() const { return values_.end(); }
+	inline size_t size() const { return values_.size(); }
 };
 
-template <> template <>
-inline const Proc<kvm::Proc>::PidMap &Proc<kvm::Proc>::children() const
+namespace diff
 {
-	return childrenByPid_;
-}
 
-template <> template <>
-inline const Proc<kvm::Proc>::NameMap &Proc<kvm::Proc>::children() const
+enum Change { Same, Appeared, Exited, Reparented, Changed, Collapsed };
+
+// a process from the newer table, one from the older table that has since
+// exited, or a count standing in for the subtrees under a parent where
+// nothing changed
+template <typename Type>
+struct Proc
+{
+	pid_t pid_, ppid_;
+	uid_t ruid_;
+	Change change_;
+	const char *comm_;
+	snapshot::Proc *old_;
+	Type *new_;
+};
+
+template <typename Type>
+inline bool visible(Type *proc, uint32_t flags)
 {
-	return childrenByName_;
+	return flags & ShowKernel || kvm::ppid(proc) > 0 || kvm::pid(proc) == 1;
 }
 
-static void help(char *program, option options[], int code = 0)
+// merges an older table and a newer one into a single table; a process is
+// the same in both when it has the same pid and start time, so a pid that
+// was reused in between shows up as one process that exited and another
+// that appeared
+template <typename Type>
+class Table
 {
-	std::printf("Usage: %s [options] [PID|USER]\n\nOptions:\n", basename(program));
+	typedef Proc<Type> Record;
+	typedef ::PidMap<size_t> PidMap;
 
-	for (option *option(options); option->name; ++option)
+	Arena arena_;
+	std::vector<Record> procs_;
+
+public:
+	Table(const snapshot::File &base, Type *procs, int count, uint32_t flags)
 	{
-		std::string name(option->name);
-		std::ostringstream arguments;
+		typedef snapshot::Proc *OldPointer;
+		typedef Type *Pointer;
+		PidMap olds;
+		std::vector<bool> matched(base.count());
 
-		switch (option->val)
+		olds.reserve(base.count());
+
+		_forall (OldPointer, old, base.procs(), base.procs() + base.count())
+			if (visible(old, flags))
+				olds.insert(PidMap::value_type(kvm::pid(old), _index));
+
+		olds.index();
+
+		procs_.reserve(olds.size() + count);
+
+		_forall (Pointer, proc, procs, procs + count)
 		{
-		case 'g':
-		case 'r':
-			arguments << '-' << static_cast<char>(option->val) << "PATTERN, --" << name << "=PATTERN"; break;
-		case 'H':
-			if (name != "highlight")
+			if (!visible(proc, flags))
 				continue;
 
-			arguments << "-H[PID], --highlight[=PID]"; break;
-		case 0:
-			if (name == "pid")
-				arguments << "PID, --pid=PID";
-			else if (name == "user")
-				arguments << "USER, --user=USER";
-			else
-				goto argument;
+			pid_t pid(kvm::pid(proc));
+			snapshot::Proc *old(NULL);
 
-			break;
-		case 'c':
-			if (name != "no-compact")
-				continue;
-		default:
-			arguments << '-' << static_cast<char>(option->val) << ", ";
-		argument:
-			arguments << "--" << name;
-		}
+			// the pid map keeps equal pids together
+			for (PidMap::iterator o1d(olds.find(pid)); o1d != olds.end() && o1d->first == pid; ++o1d)
+				if (!matched[o1d->second] && kvm::start(base.procs() + o1d->second) == kvm::start(proc))
+				{
+					matched[o1d->second] = true;
+					old = base.procs() + o1d->second;
 
-		const char *description("");
+					break;
+				}
 
-		switch (option->val)
-		{
-		case 'a':
-			description = "show command line arguments"; break;
-		case 'A':
-			description = "use ASCII line drawing characters"; break;
-		case 'c':
-			description = "don't compact identical subtrees"; break;
-		case 'g':
-			description = "show only trees rooted at processes with names\n                              that match the shell pattern PATTERN"; break;
-		case 'G':
-			description = "use VT100 line drawing characters"; break;
-		case 'h':
-			description = "show this help message and exit"; break;
-		case 'H':
-			description = "highlight the current process (or PID) and its\n                              ancestors"; break;
-		case 'k':
-			description = "show kernel processes"; break;
-		case 'l':
-			description = "don't truncate long lines"; break;
-		case 'n':
-			description = "sort output by PID"; break;
-		case 'p':
-			description = "show PIDs; implies -c"; break;
-		case 'r':
-			description = "show only trees rooted at processes with names\n                              that match the regular expression PATTERN"; break;
-		case 's':
-			description = "show parents of the selected process"; break;
-		case 't':
-			description = "show process titles"; break;
-		case 'u':
-			description = "show uid transitions"; break;
-		case 'U':
-			description = "use Unicode line drawing characters"; break;
-		case 'V':
-			description = "show version information and exit"; break;
-		case 0:
-			if (name == "pid")
-				description = "show only the tree rooted at the process PID";
-			else if (name == "user")
-				description = "show only trees rooted at processes of USER";
+			Change change(Appeared);
+
+			if (old)
+				change = kvm::ppid(old) != kvm::ppid(proc) ? Reparented : kvm::ruid(old) != kvm::ruid(proc) || std::strcmp(kvm::comm(old), kvm::comm(proc)) ? Changed : Same;
+
+			Record record = { pid, kvm::ppid(proc), kvm::ruid(proc), change, kvm::comm(proc), old, proc };
+
+			procs_.push_back(record);
 		}
 
-		std::printf("  %-27s %s\n", arguments.str().c_str(), description);
+		_foreach (PidMap, o1d, olds)
+			if (!matched[o1d->second])
+			{
+				snapshot::Proc *old(base.procs() + o1d->second);
+				Record record = { kvm::pid(old), kvm::ppid(old), kvm::ruid(old), Exited, kvm::comm(old), old, NULL };
+
+				procs_.push_back(record);
+			}
+
+		collapse();
 	}
 
-	std::exit(code);
-}
+	inline Record *procs() { return procs_.empty() ? NULL : &procs_[0]; }
+	inline int count() const { return procs_.size(); }
 
-template <typename Type, long minimum, long maximum>
-static Type value(char *program, option options[], bool *success = NULL)
-{
-	char *end;
-	long value(std::strtol(optarg, &end, 0));
+private:
+	// keep every process with a change at or below it and fold each
+	// subtree without one into a count on its parent; the parents are found
+	// the same way Proc::link() will find them
+	void collapse()
+	{
+		size_t size(procs_.size()), none(size);
+		PidMap pids;
+		std::vector<size_t> parents(size, none), offsets(size + 1, 0), children;
+		std::vector<bool> changed(size), folded(size);
 
-	errno = 0;
+		pids.reserve(size);
 
-	if (optarg == end || *end != '\0')
-		if (success)
-			*success = false;
-		else
+		_tforeach (std::vector<Record>, proc, procs_)
+			pids.insert(PidMap::value_type(proc->pid_, _index));
+
+		pids.index();
+
+		_tforeach (std::vector<Record>, proc, procs_)
 		{
-			warnx("Number is invalid: \"%s\"", optarg);
-			help(program, options, 1);
+			if (proc->ppid_ == -1)
+				continue;
+
+			PidMap::iterator parent(pids.find(proc->ppid_));
+
+			if (parent != pids.end() && parent->second != _index)
+				++offsets[(parents[_index] = parent->second) + 1];
 		}
-	else if (value < minimum || value == LONG_MIN && errno == ERANGE)
-	{
+
+		_repeat (size)
+			offsets[_index + 1] += offsets[_index];
+
+		children.resize(offsets[size]);
+
+		{
+			std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+
+			_repeat (size)
+				if (parents[_index] != none)
+					children[next[parents[_index]]++] = _index;
+		}
+
+		// like highlighting, stopping at anything already marked makes this
+		// linear and safe around a cycle
+		_repeat (size)
+			if (procs_[_index].change_ != Same)
+				for (size_t proc(_index); proc != none && !changed[proc]; proc = parents[proc])
+					changed[proc] = true;
+
+		std::vector<size_t> counts(size + 1, 0), stack;
+
+		_repeat (size)
+			if (!changed[_index] && (parents[_index] == none || changed[parents[_index]]))
+			{
+				size_t &count(counts[parents[_index] == none ? size : parents[_index]]);
+
+				stack.assign(1, _index);
+
+				while (!stack.empty())
+				{
+					size_t proc(stack.back());
+
+					stack.pop_back();
+
+					folded[proc] = true;
+
+					++count;
+
+					stack.insert(stack.end(), children.begin() + offsets[proc], children.begin() + offsets[proc + 1]);
+				}
+			}
+
+		std::vector<Record> procs;
+		pid_t next(-1);
+
+		procs.reserve(size);
+
+		_repeat (size + 1)
+		{
+			if (_index != size && !folded[_index])
+				procs.push_back(procs_[_index]);
+
+			if (!counts[_index])
+				continue;
+
+			char comm[64];
+
+			std::sprintf(comm, "[%lu unchanged]", static_cast<unsigned long>(counts[_index]));
+
+			// negative pids cannot clash with real ones and a root has a
+			// ppid of -1
+			const Record *parent(_index != size ? &procs_[_index] : NULL);
+			Record record = { --next, parent ? parent->pid_ : -1, parent ? parent->ruid_ : 0, Collapsed, arena_.strdup(comm), NULL, NULL };
+
+			procs.push_back(record);
+		}
+
+		procs_.swap(procs);
+	}
+};
+
+}
+
+namespace kvm
+{
+
+template <typename Type>
+inline char **getargv(kvm_t *kd, const diff::Proc<Type> *proc)
+{
+	return proc->new_ ? getargv(kd, proc->new_) : proc->old_ ? getargv(kd, proc->old_) : NULL;
+}
+
+template <typename Type>
+inline pid_t pid(diff::Proc<Type> *proc)
+{
+	return proc->pid_;
+}
+
+template <typename Type>
+inline pid_t ppid(diff::Proc<Type> *proc)
+{
+	return proc->ppid_;
+}
+
+template <typename Type>
+inline uid_t ruid(diff::Proc<Type> *proc)
+{
+	return proc->ruid_;
+}
+
+template <typename Type>
+inline char *comm(diff::Proc<Type> *proc)
+{
+	return const_cast<char *>(proc->comm_);
+}
+
+template <typename Type>
+inline uint64_t rss(diff::Proc<Type> *proc)
+{
+	return proc->new_ ? rss(proc->new_) : proc->old_ ? rss(proc->old_) : 0;
+}
+
+template <typename Type>
+inline uint64_t cpu(diff::Proc<Type> *proc)
+{
+	return proc->new_ ? cpu(proc->new_) : proc->old_ ? cpu(proc->old_) : 0;
+}
+
+template <typename Type>
+inline unsigned threads(diff::Proc<Type> *proc)
+{
+	return proc->new_ ? threads(proc->new_) : proc->old_ ? threads(proc->old_) : 0;
+}
+
+// what is written after a process, like its pid, to show how it changed
+template <typename Type>
+inline const char *mark(Type *)
+{
+	return "";
+}
+
+template <typename Type>
+inline const char *mark(diff::Proc<Type> *proc)
+{
+	switch (proc->change_)
+	{
+	case diff::Appeared:
+		return "new";
+	case diff::Exited:
+		return "exited";
+	case diff::Reparented:
+		return "moved";
+	case diff::Changed:
+		return "changed";
+	default:
+		return "";
+	}
+}
+
+// read the argv of procs ahead of time where that can be done all at once
+template <typename Type>
+inline void prefetch(kvm_t *, Type *const *, size_t)
+{
+}
+
+#ifdef HAVE_PROCFS
+inline void prefetch(kvm_t *kd, proc::Proc *const *procs, size_t count)
+{
+	kd->prefetch(procs, count);
+}
+#endif
+
+template <typename Type>
+inline void prefetch(kvm_t *kd, diff::Proc<Type> *const *procs, size_t count)
+{
+	std::vector<Type *> news;
+
+	_repeat (count)
+		if (procs[_index]->new_)
+			news.push_back(procs[_index]->new_);
+
+	if (!news.empty())
+		prefetch(kd, &news[0], news.size());
+}
+
+}
+
+template <typename Type>
+struct Proc
+{
+	typedef ::PidMap<Proc<Type> *> PidMap;
+	typedef Proc<Type> **Iterator;
+
+private:
+	const uint32_t &flags_;
+	Arena *arena_;
+	Users &users_;
+	kvm_t *kd_;
+	Type *proc_;
+	const Names::Name *name_;
+	mutable const char *print_;
+	mutable const char **argv_;
+	Proc<Type> *parent_;
+	Proc<Type> **children_;
+	size_t count_, mark_;
+	bool highlight_, root_, top_;
+	size_t duplicate_, hash_;
+	Proc<Type> *class_, *next_, *group_;
+	const void *owner_;
+
+	// this proc and everything under it
+	struct Total
+	{
+		size_t count_;
+		uint64_t rss_, cpu_, threads_;
+	} total_;
+
+public:
+	inline Proc(const uint32_t &flags, Arena &arena, Users &users, Names &names, kvm_t *kd, Type *proc) : flags_(flags), arena_(&arena), users_(users), kd_(kd), proc_(proc), name_(names(kvm::comm(proc))), print_(NULL), argv_(NULL), parent_(NULL), children_(NULL), count_(0), mark_(0), highlight_(false), root_(false), top_(false), duplicate_(0), hash_(0), class_(NULL), next_(NULL), group_(NULL), owner_(NULL), total_() {}
+
+	// a line with no process behind it, standing in for what --top or
+	// --max-depth leaves out
+	inline Proc(const uint32_t &flags, Arena &arena, Users &users, const char *label) : flags_(flags), arena_(&arena), users_(users), kd_(NULL), proc_(NULL), name_(Names::label(arena, label)), print_(label), argv_(new (arena) const char *(NULL)), parent_(NULL), children_(NULL), count_(0), mark_(0), highlight_(false), root_(false), top_(false), duplicate_(0), hash_(0), class_(NULL), next_(NULL), group_(NULL), owner_(NULL), total_() {}
+
+	inline const char *name() const { return name_->visual_; }
+
+	inline pid_t parent() const { return kvm::ppid(proc_); }
+	inline pid_t pid() const { return kvm::pid(proc_); }
+	inline uid_t uid() const { return kvm::ruid(proc_); }
+
+	// whether --uid-changes shows the user; only settled once root() has
+	// been asked
+	inline bool change() const
+	{
+		return flags_ & UidChanges && (root_ ? !(flags_ & User) && uid() : parent_ && uid() != parent_->uid());
+	}
+
+	// count children, hand each parent a contiguous range of one shared
+	// array, then fill the ranges in pid order and sort them by name only
+	// when that is the order the run will walk them in
+	static void link(PidMap &pids, Arena &arena, uint32_t flags)
+	{
+		size_t count(0);
+
+		_tforeach (PidMap, pid, pids)
+		{
+			Proc *proc(pid->second);
+
+			if (proc->parent() == -1)
+				continue;
+
+			typename PidMap::iterator parent(pids.find(proc->parent()));
+
+			if (parent != pids.end() && parent->second != proc)
+			{
+				proc->parent_ = parent->second;
+
+				++proc->parent_->count_;
+				++count;
+			}
+		}
+
+		Statistics::count(Statistics::Linked, count);
+
+		Iterator children(static_cast<Iterator>(arena.allocate(count * sizeof (Proc *))));
+
+		_tforeach (PidMap, pid, pids)
+		{
+			Proc *proc(pid->second);
+
+			proc->children_ = children;
+			children += proc->count_;
+			proc->count_ = 0;
+		}
+
+		_tforeach (PidMap, pid, pids)
+		{
+			Proc *parent(pid->second->parent_);
+
+			if (parent)
+				parent->children_[parent->count_++] = pid->second;
+		}
+
+		if (!(flags & NumericSort))
+			_tforeach (PidMap, pid, pids)
+			{
+				Proc *proc(pid->second);
+
+				if (proc->count_ > 1)
+					std::stable_sort(proc->children_, proc->children_ + proc->count_, byName);
+			}
+	}
+
+	static inline bool byName(const Proc *one, const Proc *two)
+	{
+		return one->name_->rank_ < two->name_->rank_;
+	}
+
+	// heaviest first by the subtree totals from weigh()
+	static inline bool byRss(const Proc *one, const Proc *two) { return one->total_.rss_ > two->total_.rss_; }
+	static inline bool byCpu(const Proc *one, const Proc *two) { return one->total_.cpu_ > two->total_.cpu_; }
+	static inline bool byCount(const Proc *one, const Proc *two) { return one->total_.count_ > two->total_.count_; }
+
+	static bool (*byWeight(bool rss, bool cpu))(const Proc *, const Proc *)
+	{
+		return rss ? byRss : cpu ? byCpu : byCount;
+	}
+
+	// add up what every subtree uses in one post-order pass over the forest
+	// untangle() left, with a stack of each proc on the way down and the
+	// index of its next child to visit
+	static void weigh(PidMap &pids)
+	{
+		typedef std::pair<Proc *, size_t> Frame;
+		std::vector<Frame> stack;
+
+		_tforeach (PidMap, pid, pids)
+		{
+			if (pid->second->parent_)
+				continue;
+
+			stack.push_back(Frame(pid->second, 0));
+
+			while (!stack.empty())
+			{
+				Frame &frame(stack.back());
+				Proc *proc(frame.first);
+
+				if (frame.second != proc->count_)
+				{
+					Proc *child(proc->children_[frame.second++]);
+
+					stack.push_back(Frame(child, 0));
+
+					continue;
+				}
+
+				stack.pop_back();
+
+				Total &total(proc->total_);
+
+				++total.count_;
+				total.rss_ += kvm::rss(proc->proc_);
+				total.cpu_ += kvm::cpu(proc->proc_);
+				total.threads_ += kvm::threads(proc->proc_);
+
+				if (Proc *parent = proc->parent_)
+				{
+					parent->total_.count_ += total.count_;
+					parent->total_.rss_ += total.rss_;
+					parent->total_.cpu_ += total.cpu_;
+					parent->total_.threads_ += total.threads_;
+				}
+			}
+		}
+	}
+
+	// reorder every set of children by weight; those that weigh the same
+	// stay in the order link() left them in
+	static void sort(PidMap &pids, uint32_t flags)
+	{
+		bool (*heavier)(const Proc *, const Proc *)(byWeight(flags & RssSort, flags & CpuSort));
+
+		_tforeach (PidMap, pid, pids)
+		{
+			Proc *proc(pid->second);
+
+			if (proc->count_ > 1)
+				std::stable_sort(proc->children_, proc->children_ + proc->count_, heavier);
+		}
+	}
+
+	// a ppid cycle, which pid reuse can make, leaves its members and
+	// everything under them out of reach of any root; walk up from each
+	// process nothing reached and cut the cycle where the walk comes back
+	// around so that it shows up as a tree of its own
+	static void untangle(PidMap &pids)
+	{
+		enum { Unseen, Reached };
+
+		size_t reached(0);
+		std::vector<Proc *> stack;
+
+		_tforeach (PidMap, pid, pids)
+			if (!pid->second->parent_)
+				stack.push_back(pid->second);
+
+		while (!stack.empty())
+		{
+			Proc *proc(stack.back());
+
+			stack.pop_back();
+
+			proc->mark_ = Reached;
+
+			++reached;
+
+			stack.insert(stack.end(), proc->children_, proc->children_ + proc->count_);
+		}
+
+		if (reached == pids.size())
+			return;
+
+		size_t walk(Reached);
+
+		_tforeach (PidMap, pid, pids)
+		{
+			Proc *proc(pid->second);
+
+			if (proc->mark_ != Unseen)
+				continue;
+
+			for (++walk; proc->mark_ == Unseen; proc = proc->parent_)
+				proc->mark_ = walk;
+
+			if (proc->mark_ != walk)
+				continue;
+
+			Proc *parent(proc->parent_);
+			Iterator end(parent->children_ + parent->count_), child(std::find(parent->children_, end, proc));
+
+			std::copy(child + 1, end, child);
+
+			--parent->count_;
+			proc->parent_ = NULL;
+
+			Statistics::count(Statistics::Cycles);
+		}
+	}
+
+	// cut every ancestor down to the one child on the way here and return
+	// the topmost, so that drawing it shows only the line of descent
+	// followed by the whole tree under this proc; the totals from weigh()
+	// are redone on the way up so they leave out what was cut
+	Proc *parents()
+	{
+		Proc *proc(this);
+
+		for (; proc->parent_; proc = proc->parent_)
+		{
+			Proc *parent(proc->parent_);
+
+			parent->children_ = new (*arena_) Proc *(proc);
+			parent->count_ = 1;
+
+			Total &total(parent->total_);
+
+			total.count_ = proc->total_.count_ + 1;
+			total.rss_ = proc->total_.rss_ + kvm::rss(parent->proc_);
+			total.cpu_ = proc->total_.cpu_ + kvm::cpu(parent->proc_);
+			total.threads_ = proc->total_.threads_ + kvm::threads(parent->proc_);
+		}
+
+		return proc;
+	}
+
+	// anything already highlighted has had its ancestors done too, so
+	// highlighting any number of procs touches each at most once
+	inline void highlight()
+	{
+		for (Proc *proc(this); proc && !proc->highlight_; proc = proc->parent_)
+			proc->highlight_ = true;
+	}
+
+	// keep the heaviest procs under the roots and the paths down to them,
+	// taking them heaviest first off a heap of the children of what was
+	// kept so far for as long as that leaves no more than count subtrees
+	// that do not contain one another; the first child kept under a proc
+	// takes its place rather than adding one, so the line of descent into
+	// a heavy subtree goes as far down as it can before it splits, and
+	// whatever is left under each proc that was kept, all of it lighter
+	// than what was, folds into one line
+	static void top(std::vector<Proc *> &roots, size_t count, uint32_t flags)
+	{
+		Lighter lighter(byWeight(flags & RssTop, flags & CpuTop));
+		std::vector<Proc *> heap(roots), procs;
+		size_t subtrees(0);
+
+		std::make_heap(heap.begin(), heap.end(), lighter);
+
+		while (!heap.empty())
+		{
+			Proc *proc(heap.front()), *parent(proc->parent_);
+
+			// the mark of a proc that was kept counts the children kept
+			// under it
+			bool first(parent && parent->top_ && !parent->mark_);
+
+			if (!first && subtrees == count)
+				break;
+
+			if (!first)
+				++subtrees;
+
+			std::pop_heap(heap.begin(), heap.end(), lighter);
+			heap.pop_back();
+
+			if (parent && parent->top_)
+				++parent->mark_;
+
+			proc->top_ = true;
+			proc->mark_ = 0;
+
+			procs.push_back(proc);
+
+			_forall (Iterator, child, proc->children_, proc->children_ + proc->count_)
+			{
+				heap.push_back(*child);
+				std::push_heap(heap.begin(), heap.end(), lighter);
+			}
+		}
+
+		_tforeach (std::vector<Proc *>, proc, procs)
+			(*proc)->fold();
+
+		size_t more(0), kept(0);
+
+		_tforeach (std::vector<Proc *>, root, roots)
+			if ((*root)->top_)
+				roots[kept++] = *root;
+			else
+				more += (*root)->total_.count_;
+
+		if (more)
+			roots[kept++] = Proc::line(roots.front(), "... %lu more", more);
+
+		roots.resize(kept);
+	}
+
+	// end every line of descent depth procs down; a proc there with
+	// children gets a single line counting everything under it instead, so
+	// nothing after this ever goes deeper
+	static void prune(const std::vector<Proc *> &roots, size_t depth)
+	{
+		typedef std::pair<Proc *, size_t> Frame;
+		std::vector<Frame> stack;
+
+		_tforeach (const std::vector<Proc *>, root, roots)
+			stack.push_back(Frame(*root, 1));
+
+		while (!stack.empty())
+		{
+			Frame frame(stack.back());
+			Proc *proc(frame.first);
+
+			stack.pop_back();
+
+			if (!proc->count_)
+				continue;
+
+			if (frame.second != depth)
+			{
+				_forall (Iterator, child, proc->children_, proc->children_ + proc->count_)
+					stack.push_back(Frame(*child, frame.second + 1));
+
+				continue;
+			}
+
+			size_t count(proc->total_.count_ - 1);
+
+			proc->children_ = new (*proc->arena_) Proc *(Proc::line(proc, count == 1 ? "+%lu descendant" : "+%lu descendants", count));
+			proc->count_ = 1;
+		}
+	}
+
+	// get the argv of everything that will be shown in one go up front
+	// rather than in the middle of compacting and drawing, letting the
+	// process table read them all ahead first
+	static void fetch(const std::vector<Proc *> &roots)
+	{
+		std::vector<Proc *> stack(roots.rbegin(), roots.rend()), procs;
+		std::vector<Type *> types;
+
+		while (!stack.empty())
+		{
+			Proc *proc(stack.back());
+
+			stack.pop_back();
+
+			if (!proc->argv_)
+			{
+				procs.push_back(proc);
+				types.push_back(proc->proc_);
+			}
+
+			stack.insert(stack.end(), proc->children_, proc->children_ + proc->count_);
+		}
+
+		if (procs.empty())
+			return;
+
+		kvm::prefetch(procs.front()->kd_, &types[0], types.size());
+
+		_tforeach (std::vector<Proc *>, proc, procs)
+			(*proc)->argv();
+	}
+
+	// hash-cons every subtree that would print on a single line in one
+	// post-order pass, then merge the siblings that share a class
+	static void compact(Iterator begin, Iterator end, size_t size)
+	{
+		Classes classes(size);
+
+		_forall (Iterator, proc, begin, end)
+			(*proc)->compact(classes);
+
+		Statistics::count(Statistics::Comparisons, classes.comparisons());
+
+		group(begin, end, &classes);
+	}
+
+	// the same for roots split into parts to be compacted and then drawn
+	// on threads of their own, where each part gets its own arena for
+	// whatever its procs allocate from then on; roots alike are only
+	// grouped afterwards, in names order
+	static void compact(std::vector<Proc *> &roots, std::vector<Proc *> &names, Arena *arenas, size_t parts, size_t size, bool compacting)
+	{
+		Compact job = { &roots[0], arenas, size / parts, compacting, std::vector<size_t>(parts) };
+
+		workers::split(job, roots.size(), parts);
+
+		if (!compacting)
+			return;
+
+		_tforeach (std::vector<size_t>, comparisons, job.comparisons_)
+			Statistics::count(Statistics::Comparisons, *comparisons);
+
+		Classes classes(roots.size());
+
+		_tforeach (std::vector<Proc *>, name, names)
+			if ((*name)->class_)
+				(*name)->class_ = classes.find(*name);
+
+		Statistics::count(Statistics::Comparisons, classes.comparisons());
+
+		group(&names[0], &names[0] + names.size(), &classes);
+	}
+
+	// roots split into the same parts as compact() drawn into parts of tree
+	// on threads of their own and then put together in order
+	static void draw(const std::vector<Proc *> &roots, Tree &tree, size_t parts)
+	{
+		Draw job = { &roots[0], &tree, std::vector<std::string>(parts) };
+
+		workers::split(job, roots.size(), parts);
+
+		_tforeach (std::vector<std::string>, part, job.parts_)
+			tree.append(*part);
+	}
+
+	// mark the processes without a parent or, with --user, --glob or
+	// --regex, the topmost processes that match in each line of descent in
+	// one pass down from the top; nothing below a root needs to be looked
+	// at
+	static void roots(PidMap &pids, uid_t uid, Matcher &matcher, uint32_t flags)
+	{
+		std::vector<Proc *> stack;
+
+		_tforeach (PidMap, pid, pids)
+			if (!pid->second->parent_)
+				stack.push_back(pid->second);
+
+		if (!(flags & User) && !matcher)
+		{
+			_tforeach (std::vector<Proc *>, proc, stack)
+				(*proc)->root_ = true;
+
+			return;
+		}
+
+		while (!stack.empty())
+		{
+			Proc *proc(stack.back());
+
+			stack.pop_back();
+
+			if (flags & User ? proc->uid() == uid : matcher(proc->name_))
+				proc->root_ = true;
+			else
+				stack.insert(stack.end(), proc->children_, proc->children_ + proc->count_);
+		}
+	}
+
+	inline bool root() const { return root_; }
+
+	// depth first with a stack of each proc on the way down and the index
+	// of its next child to print; once the tree is full, return how many
+	// procs were left without drawing or even fetching any of them
+	size_t printTree(Tree &tree) const
+	{
+		typedef std::pair<const Proc *, size_t> Frame;
+
+		if (duplicate_ == 1)
+			return 0;
+
+		if (tree.full())
+			return count();
+
+		print(tree);
+
+		std::vector<Frame> stack(1, Frame(this, 0));
+
+		while (!stack.empty())
+		{
+			Frame &frame(stack.back());
+			const Proc *parent(frame.first);
+
+			if (frame.second == parent->count_)
+			{
+				tree.pop(parent->count_);
+				stack.pop_back();
+
+				continue;
+			}
+
+			size_t index(frame.second++);
+			Iterator child(parent->children_ + index), end(parent->children_ + parent->count_);
+			Proc *proc(*child);
+			bool l4st(index + (proc->duplicate_ ? proc->duplicate_ - 1 : 0) == parent->count_ - 1);
+
+			if (!l4st)
+			{
+				l4st = true;
+
+				_forall (Iterator, next, child + 1, end)
+					if ((*next)->duplicate_ != 1)
+					{
+						l4st = false;
+
+						break;
+					}
+			}
+
+			if (l4st)
+				frame.second = parent->count_;
+
+			if (proc->duplicate_ == 1)
+				continue;
+
+			if (tree.full())
+			{
+				size_t count(0), times(1);
+
+				// the deepest level has yet to draw the child at index, and
+				// every level above it is drawing the one before its next
+				_tforeach (std::vector<Frame>, level, stack)
+				{
+					const Proc *above(level->first);
+					Iterator first(above->children_ + (&*level == &stack.back() ? index : level->second));
+
+					if (above->duplicate_)
+						times *= above->duplicate_;
+
+					_forall (Iterator, rest, first, above->children_ + above->count_)
+						count += times * (*rest)->count();
+				}
+
+				return count;
+			}
+
+			proc->print(tree(!index, l4st));
+
+			stack.push_back(Frame(proc, 0));
+		}
+
+		return 0;
+	}
+
+	// this proc and everything under it, where a proc that compacting
+	// merged into another counts as part of that one and a line from
+	// line() counts as the procs it stands for
+	size_t count() const
+	{
+		typedef std::pair<const Proc *, size_t> Frame;
+		std::vector<Frame> stack;
+		size_t count(0);
+
+		if (duplicate_ != 1)
+			stack.push_back(Frame(this, duplicate_ ? duplicate_ : 1));
+
+		while (!stack.empty())
+		{
+			Frame frame(stack.back());
+
+			stack.pop_back();
+
+			count += frame.second * (frame.first->proc_ ? 1 : frame.first->total_.count_);
+
+			_forall (Iterator, child, frame.first->children_, frame.first->children_ + frame.first->count_)
+				if ((*child)->duplicate_ != 1)
+					stack.push_back(Frame(*child, frame.second * ((*child)->duplicate_ ? (*child)->duplicate_ : 1)));
+		}
+
+		return count;
+	}
+
+private:
+	inline const char *visual(const char *string) const
+	{
+		return ::visual(*arena_, string);
+	}
+
+	void print(Tree &tree) const
+	{
+		tree.print(print(), highlight_, duplicate_);
+
+		if (flags_ & Arguments)
+		{
+			const char **argv(this->argv());
+
+			if (*argv)
+				for (++argv; *argv; ++argv)
+					tree.printArg(*argv, !*(argv + 1));
+
+			tree.done();
+		}
+	}
+
+	// fetched and made visual at most once, however many times the title
+	// and the arguments are asked for
+	const char **argv() const
+	{
+		if (!argv_)
+		{
+			char **argv(kvm::getargv(kd_, proc_));
+			size_t count(0);
+
+			Statistics::count(Statistics::Argv);
+
+			if (argv)
+				while (argv[count])
+					++count;
+
+			argv_ = static_cast<const char **>(arena_->allocate((count + 1) * sizeof (char *)));
+
+			_repeat (count)
+				argv_[_index] = visual(argv[_index]);
+
+			argv_[count] = NULL;
+		}
+
+		return argv_;
+	}
+
+	const char *print() const
+	{
+		if (!print_)
+		{
+			const char *title(NULL);
+
+			if (flags_ & ShowTitles)
+				title = *argv();
+
+			if (!title)
+				title = name();
+
+			// the counts --diff puts in place of unchanged subtrees have
+			// negative pids
+			const char *mark(kvm::mark(proc_));
+			bool p1d(flags_ & ShowPids && pid() >= 0), args(flags_ & Arguments), change(this->change()), usage(flags_ & (ShowRss | ShowCpu | ShowThreads) && pid() >= 0);
+
+			if (!p1d && !change && !usage && !*mark)
+				return print_ = title;
+
+			bool parens(!args);
+			const char *user(change ? users_(uid()) : "");
+			size_t size(std::strlen(title));
+			char *print(static_cast<char *>(arena_->allocate(size + std::strlen(user) + std::strlen(mark) + 160))), *end(print + size);
+
+			std::memcpy(print, title, size);
+
+			if (parens)
+				*end++ = '(';
+
+			if (p1d)
+				end += std::sprintf(end, parens ? "%d" : ",%d", pid());
+
+			if (change)
+				end += std::sprintf(end, !parens || p1d ? ",%s" : "%s", user);
+
+			if (usage)
+				end = this->usage(end, !parens || p1d || change);
+
+			if (*mark)
+				end += std::sprintf(end, !parens || p1d || change || usage ? ",%s" : "%s", mark);
+
+			if (parens)
+				*end++ = ')';
+
+			*end = '\0';
+
+			arena_->shrink(print, end - print + 1);
+
+			print_ = print;
+		}
+
+		return print_;
+	}
+
+	// the weight, then the pid so the selection is the same every time;
+	// the heavier is the greater, which puts it on top of a heap
+	class Lighter
+	{
+		bool (*heavier_)(const Proc *, const Proc *);
+
+	public:
+		Lighter(bool (*heavier)(const Proc *, const Proc *)) : heavier_(heavier) {}
+
+		inline bool operator()(const Proc *one, const Proc *two) const
+		{
+			return heavier_(two, one) || !heavier_(one, two) && two->pid() < one->pid();
+		}
+	};
+
+	// a line standing in for count procs, which it keeps as its total so
+	// that count() can tell what leaving it out leaves out
+	static Proc *line(const Proc *like, const char *format, size_t count)
+	{
+		char label[64];
+
+		std::sprintf(label, format, static_cast<unsigned long>(count));
+
+		Proc *line(new (*like->arena_) Proc(like->flags_, *like->arena_, like->users_, like->arena_->strdup(label)));
+
+		line->total_.count_ = count;
+
+		return line;
+	}
+
+	// the children that were kept in the order they were in and then a
+	// line counting the procs under the rest
+	void fold()
+	{
+		size_t more(0), kept(0);
+
+		_forall (Iterator, child, children_, children_ + count_)
+			if ((*child)->top_)
+				++kept;
+			else
+				more += (*child)->total_.count_;
+
+		if (!more)
+			return;
+
+		Iterator children(static_cast<Iterator>(arena_->allocate((kept + 1) * sizeof (Proc *))));
+
+		kept = 0;
+
+		_forall (Iterator, child, children_, children_ + count_)
+			if ((*child)->top_)
+				children[kept++] = *child;
+
+		children[kept] = Proc::line(this, "... %lu more", more);
+		children_ = children;
+		count_ = kept + 1;
+	}
+
+	// each column as the value for this proc and, if it has children, the
+	// total for its subtree after a slash
+	char *usage(char *end, bool comma) const
+	{
+		char separator(comma ? ',' : '\0');
+
+		if (flags_ & ShowRss)
+		{
+			end = bytes(end, separator, kvm::rss(proc_));
+
+			if (count_)
+				end = bytes(end, '/', total_.rss_);
+
+			separator = ',';
+		}
+
+		if (flags_ & ShowCpu)
+		{
+			end = seconds(end, separator, kvm::cpu(proc_));
+
+			if (count_)
+				end = seconds(end, '/', total_.cpu_);
+
+			separator = ',';
+		}
+
+		if (flags_ & ShowThreads)
+		{
+			if (separator)
+				*end++ = separator;
+
+			end += std::sprintf(end, "%u", kvm::threads(proc_));
+
+			if (count_)
+				end += std::sprintf(end, "/%llu", static_cast<unsigned long long>(total_.threads_));
+		}
+
+		return end;
+	}
+
+	// abbreviated the way ps(1) does, so 4096 is 4.0K and 3 << 30 is 3.0G
+	static char *bytes(char *end, char separator, uint64_t bytes)
+	{
+		static const char units[] = "KMGTPE";
+		const char *unit(units);
+		double value(bytes / 1024.0);
+
+		for (; value >= 1024 && unit[1]; ++unit)
+			value /= 1024;
+
+		if (separator)
+			*end++ = separator;
+
+		return end + std::sprintf(end, value < 10 ? "%.1f%c" : "%.0f%c", value, *unit);
+	}
+
+	// seconds below a minute, then M:SS and H:MM:SS like ps(1)
+	static char *seconds(char *end, char separator, uint64_t microseconds)
+	{
+		unsigned long long seconds(microseconds / 1000000);
+
+		if (separator)
+			*end++ = separator;
+
+		if (seconds < 60)
+			return end + std::sprintf(end, "%.2fs", microseconds / 1e6);
+		else if (seconds < 3600)
+			return end + std::sprintf(end, "%llu:%02llu", seconds / 60, seconds % 60);
+		else
+			return end + std::sprintf(end, "%llu:%02llu:%02llu", seconds / 3600, seconds / 60 % 60, seconds % 60);
+	}
+
+	class Classes
+	{
+		std::vector<Proc *> buckets_;
+		size_t comparisons_;
+
+	public:
+		Classes(size_t size) : buckets_(1), comparisons_(0)
+		{
+			while (buckets_.size() < size)
+				buckets_.resize(buckets_.size() * 2);
+		}
+
+		// the first proc seen with a given shape represents all of the rest
+		Proc *find(Proc *proc)
+		{
+			Proc *&bucket(buckets_[proc->hash_ & (buckets_.size() - 1)]);
+
+			for (Proc *clas5(bucket); clas5; clas5 = clas5->next_)
+				if (clas5->hash_ == proc->hash_ && (++comparisons_, equal(clas5, proc)))
+					return clas5;
+
+			proc->next_ = bucket;
+
+			return bucket = proc;
+		}
+
+		inline size_t comparisons() const { return comparisons_; }
+	};
+
+	// the part of compact() for roots_[begin, end) done on a thread
+	struct Compact
+	{
+		Iterator roots_;
+		Arena *arenas_;
+		size_t size_;
+		bool compact_;
+		std::vector<size_t> comparisons_;
+
+		void operator()(size_t begin, size_t end, size_t worker)
+		{
+			_forall (Iterator, root, roots_ + begin, roots_ + end)
+				(*root)->adopt(arenas_[worker]);
+
+			if (!compact_)
+				return;
+
+			Classes classes(size_);
+
+			_forall (Iterator, root, roots_ + begin, roots_ + end)
+				(*root)->compact(classes);
+
+			comparisons_[worker] = classes.comparisons();
+		}
+	};
+
+	// and the part of draw()
+	struct Draw
+	{
+		typedef Proc *const *Roots;
+
+		Roots roots_;
+		const Tree *tree_;
+		std::vector<std::string> parts_;
+
+		void operator()(size_t begin, size_t end, size_t worker)
+		{
+			Tree tree(*tree_, parts_[worker]);
+
+			_forall (Roots, root, roots_ + begin, roots_ + end)
+				(*root)->printTree(tree);
+		}
+	};
+
+	// allocate from arena from now on, everywhere in this tree
+	void adopt(Arena &arena)
+	{
+		std::vector<Proc *> stack(1, this);
+
+		while (!stack.empty())
+		{
+			Proc *proc(stack.back());
+
+			stack.pop_back();
+
+			proc->arena_ = &arena;
+
+			stack.insert(stack.end(), proc->children_, proc->children_ + proc->count_);
+		}
+	}
+
+	// post-order with a stack of each proc on the way down and the index of
+	// its next child to visit
+	void compact(Classes &classes)
+	{
+		typedef std::pair<Proc *, size_t> Frame;
+		std::vector<Frame> stack(1, Frame(this, 0));
+
+		while (!stack.empty())
+		{
+			Frame &frame(stack.back());
+			Proc *proc(frame.first);
+
+			if (frame.second != proc->count_)
+			{
+				Proc *child(proc->children_[frame.second++]);
+
+				stack.push_back(Frame(child, 0));
+
+				continue;
+			}
+
+			stack.pop_back();
+
+			if (!group(proc->children_, proc->children_ + proc->count_, proc))
+				continue;
+
+			const char *print(proc->print());
+
+			proc->hash_ = hash(print == proc->name() ? proc->name_->hash_ : Names::hash(print), proc->count_, proc->count_ ? (*proc->children_)->hash_ : 0);
+			proc->class_ = classes.find(proc);
+		}
+	}
+
+	// true if every sibling ended up in the same class, which is what it
+	// takes for their parent to still print on a single line
+	static bool group(Iterator begin, Iterator end, const void *owner)
+	{
+		size_t groups(0);
+		bool compact(true);
+
+		_forall (Iterator, proc, begin, end)
+		{
+			Proc *clas5((*proc)->class_);
+
+			if (!clas5)
+				compact = false;
+			else if (clas5->owner_ != owner)
+			{
+				clas5->owner_ = owner;
+				clas5->group_ = *proc;
+
+				++groups;
+			}
+			else
+				merge(clas5->group_, *proc);
+		}
+
+		return compact && groups <= 1;
+	}
+
+	static void merge(Proc *leader, Proc *proc)
+	{
+		leader->duplicate_ = leader->duplicate_ ? leader->duplicate_ + 1 : 2;
+		proc->duplicate_ = 1;
+
+		// the highlighted path has to survive in the copy that gets printed
+		while (proc && proc->highlight_)
+		{
+			leader->highlight_ = true;
+			leader = leader->count_ ? *leader->children_ : NULL;
+
+			Proc *highlight(NULL);
+
+			_forall (Iterator, child, proc->children_, proc->children_ + proc->count_)
+				if ((*child)->highlight_)
+				{
+					highlight = *child;
+
+					break;
+				}
+
+			proc = leader ? highlight : NULL;
+		}
+	}
+
+	// every child of a proc with a class is in the same class, so it is
+	// enough to follow the first ones down until the classes are the same;
+	// from the same Classes that is right away, but trees compacted apart
+	// have classes of their own
+	static inline bool equal(const Proc *one, const Proc *two)
+	{
+		for (;;)
+		{
+			if (one->count_ != two->count_ || one->print() != two->print() && std::strcmp(one->print(), two->print()))
+				return false;
+
+			if (!one->count_)
+				return true;
+
+			one = (*one->children_)->class_;
+			two = (*two->children_)->class_;
+
+			if (one == two)
+				return true;
+		}
+	}
+
+	static inline size_t hash(size_t string, size_t count, size_t child)
+	{
+		size_t hash((string ^ count) * 16777619U);
+
+		return (hash ^ child) * 16777619U;
+	}
+};
+
+static void help(char *program, option options[], int code = 0)
+{
+	std::printf("Usage: %s [options] [PID|USER]\n\nOptions:\n", basename(program));
+
+	for (option *option(options); option->name; ++option)
+	{
+		std::string name(option->name);
+		std::ostringstream arguments;
+
+		switch (option->val)
+		{
+		case 'g':
+		case 'r':
+			arguments << '-' << static_cast<char>(option->val) << "PATTERN, --" << name << "=PATTERN"; break;
+		case 'H':
+			if (name != "highlight")
+				continue;
+
+			arguments << "-H[PID], --highlight[=PID]"; break;
+		case 0:
+			if (name == "pid")
+				arguments << "PID, --pid=PID";
+			else if (name == "user")
+				arguments << "USER, --user=USER";
+			else if (name == "highlight-user")
+				arguments << "--" << name << "=USER";
+			else if (name == "highlight-file" || name == "diff" || name == "load-snapshot" || name == "save-snapshot")
+				arguments << "--" << name << "=FILE";
+			else if (name == "watch")
+				arguments << "--" << name << "=SECONDS";
+			else if (name == "show-usage")
+				arguments << "--" << name << "[=LIST]";
+			else if (name == "sort-by" || name == "by")
+				arguments << "--" << name << "=KEY";
+			else if (name == "top" || name == "max-depth")
+				arguments << "--" << name << "=N";
+			else if (name == "max-lines")
+				arguments << "--" << name << "[=N]";
+			else
+				goto argument;
+
+			break;
+		case 'c':
+			if (name != "no-compact")
+				continue;
+		default:
+			arguments << '-' << static_cast<char>(option->val) << ", ";
+		argument:
+			arguments << "--" << name;
+		}
+
+		const char *description("");
+
+		switch (option->val)
+		{
+		case 'a':
+			description = "show command line arguments"; break;
+		case 'A':
+			description = "use ASCII line drawing characters"; break;
+		case 'c':
+			description = "don't compact identical subtrees"; break;
+		case 'g':
+			description = "show only trees rooted at processes with names\n                              that match the shell pattern PATTERN"; break;
+		case 'G':
+			description = "use VT100 line drawing characters"; break;
+		case 'h':
+			description = "show this help message and exit"; break;
+		case 'H':
+			description = "highlight the current process (or PID) and its\n                              ancestors; may be given more than once"; break;
+		case 'k':
+			description = "show kernel processes"; break;
+		case 'l':
+			description = "don't truncate long lines"; break;
+		case 'n':
+			description = "sort output by PID"; break;
+		case 'p':
+			description = "show PIDs; implies -c"; break;
+		case 'r':
+			description = "show only trees rooted at processes with names\n                              that match the regular expression PATTERN"; break;
+		case 's':
+			description = "show parents of the selected process"; break;
+		case 't':
+			description = "show process titles"; break;
+		case 'u':
+			description = "show uid transitions"; break;
+		case 'U':
+			description = "use Unicode line drawing characters"; break;
+		case 'V':
+			description = "show version information and exit"; break;
+		case 0:
+			if (name == "pid")
+				description = "show only the tree rooted at the process PID";
+			else if (name == "user")
+				description = "show only trees rooted at processes of USER";
+			else if (name == "highlight-user")
+				description = "highlight every process of USER and its\n                              ancestors";
+			else if (name == "highlight-file")
+				description = "highlight every PID listed in FILE (or - for\n                              standard input) and its ancestors";
+			else if (name == "diff")
+				description = "show what changed since the processes saved in\n                              FILE were running";
+			else if (name == "load-snapshot")
+				description = "show the processes saved in FILE instead of the\n                              running ones";
+			else if (name == "save-snapshot")
+				description = "also save the processes to FILE";
+			else if (name == "stats")
+				description = "write how long each phase took to standard error";
+			else if (name == "watch")
+				description = "redraw the tree in place every SECONDS until\n                              interrupted";
+			else if (name == "show-usage")
+				description = "show the RSS, CPU time and threads of each\n                              process and its subtree; LIST picks any of\n                              rss, cpu and threads";
+			else if (name == "sort-by")
+				description = "sort by the rss, cpu or count of each subtree,\n                              heaviest first";
+			else if (name == "top")
+				description = "show only the N heaviest subtrees and the paths\n                              down to them";
+			else if (name == "by")
+				description = "weigh subtrees for --top by their rss, cpu or\n                              count (the default)";
+			else if (name == "max-depth")
+				description = "show only N levels of each tree and count the\n                              descendants below them";
+			else if (name == "max-lines")
+				description = "stop after N lines (or a screenful on a\n                              terminal) and count the processes left out";
+		}
+
+		std::printf("  %-27s %s\n", arguments.str().c_str(), description);
+	}
+
+	std::exit(code);
+}
+
+template <typename Type, long minimum, long maximum>
+static Type value(char *program, option options[], bool *success = NULL)
+{
+	char *end;
+	long value(std::strtol(optarg, &end, 0));
+
+	errno = 0;
+
+	if (optarg == end || *end != '\0')
+		if (success)
+			*success = false;
+		else
+		{
+			warnx("Number is invalid: \"%s\"", optarg);
+			help(program, options, 1);
+		}
+	else if (value < minimum || value == LONG_MIN && errno == ERANGE)
+	{
 		warnx("Number is too small: \"%s\"", optarg);
 		help(program, options, 1);
 	}
@@ -978,7 +3357,7 @@ static Type value(char *program, option options[], bool *success = NULL)
 	return value;
 }
 
-static uint16_t options(int argc, char *argv[], char *&glob, pid_t &hpid, pid_t &pid, char *&regex, char *&user)
+static uint32_t options(int argc, char *argv[], char *&glob, std::vector<pid_t> &hpids, char *&huser, char *&hfile, pid_t &pid, char *&regex, char *&user, char *&base, char *&load, char *&save, double &interval, Limits &limits)
 {
 	option options[] = {
 		{ "arguments", no_argument, NULL, 'a' },
@@ -991,6 +3370,8 @@ static uint16_t options(int argc, char *argv[], char *&glob, pid_t &hpid, pid_t
 		{ "highlight", optional_argument, NULL, 'H' },
 		{ "highlight-all", no_argument, NULL, 'H' },
 		{ "highlight-pid", required_argument, NULL, 'H' },
+		{ "highlight-user", required_argument, NULL, 0 },
+		{ "highlight-file", required_argument, NULL, 0 },
 		{ "show-kernel", no_argument, NULL, 'k' },
 		{ "long", no_argument, NULL, 'l' },
 		{ "numeric-sort", no_argument, NULL, 'n' },
@@ -1001,15 +3382,26 @@ static uint16_t options(int argc, char *argv[], char *&glob, pid_t &hpid, pid_t
 		{ "uid-changes", no_argument, NULL, 'u' },
 		{ "unicode", no_argument, NULL, 'U' },
 		{ "version", optional_argument, NULL, 'V' },
+		{ "diff", required_argument, NULL, 0 },
+		{ "load-snapshot", required_argument, NULL, 0 },
+		{ "save-snapshot", required_argument, NULL, 0 },
+		{ "stats", no_argument, NULL, 0 },
+		{ "watch", required_argument, NULL, 0 },
+		{ "show-usage", optional_argument, NULL, 0 },
+		{ "sort-by", required_argument, NULL, 0 },
+		{ "top", required_argument, NULL, 0 },
+		{ "by", required_argument, NULL, 0 },
+		{ "max-depth", required_argument, NULL, 0 },
+		{ "max-lines", optional_argument, NULL, 0 },
 		{ "pid", required_argument, NULL, 0 },
 		{ "user", required_argument, NULL, 0 },
 		{ NULL, 0, NULL, 0 }
 	};
 	int option, index;
-	uint16_t flags(0);
+	uint32_t flags(0);
 	char *program(argv[0]);
 
-	while ((option = getopt_long(argc, argv, "aAcg:GhH::klnpr:tuUV::", options, &index)) != -1)
+	while ((option = getopt_long(argc, argv, "aAcg:GhH::klnpr:stuUV::", options, &index)) != -1)
 		switch (option)
 		{
 		case 'a':
@@ -1036,7 +3428,7 @@ static uint16_t options(int argc, char *argv[], char *&glob, pid_t &hpid, pid_t
 		case 'h':
 			help(program, options);
 		case 'H':
-			hpid = optarg ? value<pid_t, 0, INT_MAX>(program, options) : getpid();
+			hpids.push_back(optarg ? value<pid_t, 0, INT_MAX>(program, options) : getpid());
 			flags |= Highlight;
 
 			break;
@@ -1056,6 +3448,8 @@ static uint16_t options(int argc, char *argv[], char *&glob, pid_t &hpid, pid_t
 			flags &= ~Glob & ~Pid & ~User;
 
 			break;
+		case 's':
+			flags |= ShowParents; break;
 		case 't':
 			flags |= ShowTitles; break;
 		case 'u':
@@ -1102,17 +3496,140 @@ static uint16_t options(int argc, char *argv[], char *&glob, pid_t &hpid, pid_t
 
 				if (option == "pid")
 				{
-					pid = value<pid_t, 0, INT_MAX>(program, options);
-					flags |= Pid;
-					flags &= ~Glob & ~Regex & ~User;
+					pid = value<pid_t, 0, INT_MAX>(program, options);
+					flags |= Pid;
+					flags &= ~Glob & ~Regex & ~User;
+				}
+				else if (option == "user")
+				{
+					std::free(user);
+
+					user = strdup(optarg);
+					flags |= User;
+					flags &= ~Glob & ~Pid & ~Regex;
+				}
+				else if (option == "highlight-user")
+				{
+					std::free(huser);
+
+					huser = strdup(optarg);
+					flags |= Highlight | HighlightUser;
+				}
+				else if (option == "highlight-file")
+				{
+					std::free(hfile);
+
+					hfile = strdup(optarg);
+					flags |= Highlight;
+				}
+				else if (option == "diff")
+				{
+					std::free(base);
+
+					base = strdup(optarg);
+				}
+				else if (option == "load-snapshot")
+				{
+					std::free(load);
+
+					load = strdup(optarg);
+				}
+				else if (option == "save-snapshot")
+				{
+					std::free(save);
+
+					save = strdup(optarg);
+				}
+				else if (option == "stats")
+					flags |= Stats;
+				else if (option == "watch")
+				{
+					char *end;
+
+					interval = std::strtod(optarg, &end);
+
+					if (optarg == end || *end != '\0' || !(interval > 0) || interval > 86400)
+					{
+						warnx("Interval is invalid: \"%s\"", optarg);
+						help(program, options, 1);
+					}
+
+					flags |= Watch;
+				}
+				else if (option == "show-usage")
+				{
+					std::string list(optarg ? optarg : "rss,cpu,threads");
+
+					flags &= ~ShowRss & ~ShowCpu & ~ShowThreads;
+
+					for (size_t start(0), end; start <= list.size(); start = end + 1)
+					{
+						if ((end = list.find(',', start)) == std::string::npos)
+							end = list.size();
+
+						std::string column(list, start, end - start);
+
+						if (column == "rss")
+							flags |= ShowRss;
+						else if (column == "cpu")
+							flags |= ShowCpu;
+						else if (column == "threads")
+							flags |= ShowThreads;
+						else
+						{
+							warnx("Column is invalid: \"%s\"", column.c_str());
+							help(program, options, 1);
+						}
+					}
+				}
+				else if (option == "sort-by")
+				{
+					std::string key(optarg);
+
+					flags &= ~RssSort & ~CpuSort & ~CountSort;
+
+					if (key == "rss")
+						flags |= RssSort;
+					else if (key == "cpu")
+						flags |= CpuSort;
+					else if (key == "count")
+						flags |= CountSort;
+					else
+					{
+						warnx("Sort key is invalid: \"%s\"", optarg);
+						help(program, options, 1);
+					}
+				}
+				else if (option == "top")
+				{
+					limits.top_ = value<unsigned, 1, INT_MAX>(program, options);
+					flags |= Top;
+				}
+				else if (option == "max-depth")
+				{
+					limits.depth_ = value<unsigned, 1, INT_MAX>(program, options);
+					flags |= MaxDepth;
+				}
+				else if (option == "max-lines")
+				{
+					limits.lines_ = optarg ? value<unsigned, 1, INT_MAX>(program, options) : 0;
+					flags |= MaxLines;
 				}
-				else if (option == "user")
+				else if (option == "by")
 				{
-					std::free(user);
+					std::string key(optarg);
 
-					user = strdup(optarg);
-					flags |= User;
-					flags &= ~Glob & ~Pid & ~Regex;
+					flags &= ~RssTop & ~CpuTop;
+
+					if (key == "rss")
+						flags |= RssTop;
+					else if (key == "cpu")
+						flags |= CpuTop;
+					else if (key != "count")
+					{
+						warnx("Sort key is invalid: \"%s\"", optarg);
+						help(program, options, 1);
+					}
 				}
 			}
 
@@ -1146,135 +3663,570 @@ static uint16_t options(int argc, char *argv[], char *&glob, pid_t &hpid, pid_t
 	return flags;
 }
 
-template <typename Type, int Flags>
-static void tree(pid_t hpid, pid_t pid, uint16_t flags, uid_t uid)
+template <typename Type>
+static void tree(kvm_t *kd, Type *procs, int count, const Highlights &highlights, const Limits &limits, pid_t pid, uint32_t flags, uid_t uid, Matcher &matcher, Statistics &stats, std::string *frame = NULL)
 {
-	char error[_POSIX2_LINE_MAX];
-	kvm_t *kd(kvm_openfiles(NULL, _PATH_DEVNULL, NULL, Flags, error));
-
-	if (!kd)
-		errx(1, "%s", error);
-
-	int count;
-	Type *procs(kvm::getprocs<Type>(kd, count));
-
-	if (!procs)
-		errx(1, "%s", kvm_geterr(kd));
-
 	typedef Type *Pointer;
+	Arena arena;
+	Users users(arena);
+	Names commands(arena);
 	typename Proc<Type>::PidMap pids;
 
+	Statistics::count(Statistics::Procs, count);
+
+	pids.reserve(count);
+
 	_forall (Pointer, proc, procs, procs + count)
 		if (flags & ShowKernel || kvm::ppid(proc) > 0 || kvm::pid(proc) == 1)
-			pids.insert(typename Proc<Type>::PidMap::value_type(kvm::pid(proc), new Proc<Type>(flags, kd, proc)));
+			pids.insert(typename Proc<Type>::PidMap::value_type(kvm::pid(proc), new (arena) Proc<Type>(flags, arena, users, commands, kd, proc)));
 
-	enum { PidSort, NameSort } sort(flags & NumericSort ? PidSort : NameSort);
+	pids.index();
+	commands.rank();
 
-	_tforeach (typename Proc<Type>::PidMap, pid, pids)
-	{
-		Proc<Type> *proc(pid->second);
+	stats.phase("build");
 
-		if (proc->parent() == -1)
-			continue;
+	// a single tree from --pid has nothing to sort, --sort-by sorts by
+	// weight whether or not the children are in pid order, and --top may
+	// leave out some roots
+	enum { PidSort, NameSort } sort(flags & NumericSort && !(flags & (Pid | RssSort | CpuSort | CountSort | Top)) ? PidSort : NameSort);
+
+	Proc<Type>::link(pids, arena, flags);
+	Proc<Type>::untangle(pids);
+
+	if (flags & Highlight)
+	{
+		_foreach (const std::vector<pid_t>, hpid, highlights.pids_)
+		{
+			typename Proc<Type>::PidMap::iterator pid(pids.find(*hpid));
 
-		typename Proc<Type>::PidMap::iterator parent(pids.find(proc->parent()));
+			if (pid != pids.end())
+				pid->second->highlight();
+		}
 
-		if (parent != pids.end())
-			parent->second->child(proc);
+		if (flags & HighlightUser)
+			_tforeach (typename Proc<Type>::PidMap, pid, pids)
+				if (pid->second->uid() == highlights.uid_)
+					pid->second->highlight();
 	}
 
-	if (flags & Highlight)
+	stats.phase("link");
+
+	if (flags & (ShowRss | ShowCpu | ShowThreads | RssSort | CpuSort | CountSort | Top | MaxDepth))
 	{
-		typename Proc<Type>::PidMap::iterator pid(pids.find(hpid));
+		Proc<Type>::weigh(pids);
+
+		if (flags & (RssSort | CpuSort | CountSort))
+			Proc<Type>::sort(pids, flags);
 
-		if (pid != pids.end())
-			pid->second->highlight();
+		stats.phase("weigh");
 	}
 
-	Tree tree(flags);
+	std::vector<Proc<Type> *> names;
 
 	if (flags & Pid)
 	{
 		typename Proc<Type>::PidMap::iterator p1d(pids.find(pid));
 
 		if (p1d != pids.end())
-		{
-			Proc<Type> *proc(p1d->second);
-
-			if (!(flags & NoCompact))
-				proc->compact();
-
-			switch (sort)
-			{
-			case PidSort:
-				proc->printByPid(tree);
-
-				break;
-			case NameSort:
-				proc->printByName(tree);
-			}
-		}
+			names.push_back(flags & ShowParents ? p1d->second->parents() : p1d->second);
 	}
 	else
 	{
-		typename Proc<Type>::NameMap names;
+		Proc<Type>::roots(pids, uid, matcher, flags);
 
 		_tforeach (typename Proc<Type>::PidMap, pid, pids)
 		{
 			Proc<Type> *proc(pid->second);
 
-			if (proc->root(uid))
-				names.insert(typename Proc<Type>::NameMap::value_type(proc->name(), proc));
+			if (proc->root())
+				names.push_back(proc);
 		}
 
-		if (!(flags & NoCompact))
-			Proc<Type>::compact(names);
+		std::stable_sort(names.begin(), names.end(), Proc<Type>::byName);
+
+		if (flags & (RssSort | CpuSort | CountSort))
+			std::stable_sort(names.begin(), names.end(), Proc<Type>::byWeight(flags & RssSort, flags & CpuSort));
+	}
+
+	stats.phase("roots");
+
+	if (flags & Top)
+	{
+		Proc<Type>::top(names, limits.top_, flags);
+
+		stats.phase("top");
+	}
+
+	if (flags & MaxDepth)
+	{
+		Proc<Type>::prune(names, limits.depth_);
+
+		stats.phase("depth");
+	}
+
+	// with a line budget, only what gets drawn is fetched, as it is drawn,
+	// apart from the titles compacting compares
+	if (flags & (Arguments | ShowTitles) && !(flags & MaxLines))
+		Proc<Type>::fetch(names);
+
+	stats.phase("argv");
+
+	if (flags & UidChanges)
+	{
+		std::vector<uid_t> uids;
+
+		_tforeach (typename Proc<Type>::PidMap, pid, pids)
+			if (pid->second->change())
+				uids.push_back(pid->second->uid());
+
+		std::sort(uids.begin(), uids.end());
+		uids.erase(std::unique(uids.begin(), uids.end()), uids.end());
+
+		users.load(uids);
+
+		// drawing on several threads has to find every one already there
+		_tforeach (std::vector<uid_t>, uid, uids)
+			users(*uid);
+
+		stats.phase("users");
+	}
+
+	// the roots in the order they are drawn
+	std::vector<Proc<Type> *> roots;
+
+	if (sort == PidSort)
+		_tforeach (typename Proc<Type>::PidMap, pid, pids)
+			if (pid->second->root())
+				roots.push_back(pid->second);
+
+	std::vector<Proc<Type> *> &order(sort == PidSort ? roots : names);
+
+	// separate trees are compacted and drawn in parts on threads of their
+	// own, unless a line budget has them drawn in turn, with argv fetched
+	// along the way; each part allocates from its own arena
+	size_t parts(flags & MaxLines ? 1 : std::min(workers::count(pids.size()), order.size()));
+	Arena arenas[workers::Most];
+
+	if (parts > 1)
+		Proc<Type>::compact(order, names, arenas, parts, pids.size(), !(flags & NoCompact));
+	else if (!(flags & NoCompact) && !names.empty())
+		Proc<Type>::compact(&names[0], &names[0] + names.size(), pids.size());
 
-		switch (sort)
+	stats.phase("compact");
+
+	{
+		// leave room for the summary and the prompt after it
+		size_t budget(flags & MaxLines ? limits.lines_ ? limits.lines_ : isatty(1) ? std::max<size_t>(rows(), 3) - 2 : 0 : 0), omitted(0);
+		Tree tree(flags, frame, budget);
+
+		if (parts > 1)
+			Proc<Type>::draw(order, tree, parts);
+		else switch (sort)
 		{
 		case PidSort:
 			_tforeach (typename Proc<Type>::PidMap, pid, pids)
 			{
 				Proc<Type> *proc(pid->second);
 
-				if (proc->root(uid))
-					proc->printByPid(tree);
+				if (proc->root())
+					omitted += proc->printTree(tree);
 			}
 
 			break;
 		case NameSort:
-			_tforeach (typename Proc<Type>::NameMap, name, names)
-				name->second->printByName(tree);
+			_tforeach (std::vector<Proc<Type> *>, name, names)
+				omitted += (*name)->printTree(tree);
+		}
+
+		if (omitted)
+			tree.omit(omitted);
+	}
+
+	stats.phase("render");
+}
+
+// with --diff, what changed since the older table rather than the processes
+// themselves; the kernel processes are left out of the merged table already
+template <typename Type>
+static void tree(kvm_t *kd, Type *procs, int count, const snapshot::File *base, const Highlights &highlights, const Limits &limits, pid_t pid, uint32_t flags, uid_t uid, Matcher &matcher, Statistics &stats)
+{
+	if (base)
+	{
+		diff::Table<Type> table(*base, procs, count, flags);
+
+		stats.phase("diff");
+
+		tree(kd, table.procs(), table.count(), highlights, limits, pid, flags | ShowKernel, uid, matcher, stats);
+	}
+	else
+		tree(kd, procs, count, highlights, limits, pid, flags, uid, matcher, stats);
+}
+
+// just enough of a process table to tell whether the next one is any
+// different
+class Digest
+{
+	struct Record
+	{
+		pid_t pid_, ppid_;
+		uid_t ruid_;
+		size_t comm_, argv_;
+		uint64_t rss_, cpu_;
+		unsigned threads_;
+
+		inline bool operator!=(const Record &other) const { return pid_ != other.pid_ || ppid_ != other.ppid_ || ruid_ != other.ruid_ || comm_ != other.comm_ || argv_ != other.argv_ || rss_ != other.rss_ || cpu_ != other.cpu_ || threads_ != other.threads_; }
+	};
+
+	std::vector<Record> records_, next_;
+	std::vector<char> comms_, nextComms_;
+	bool argv_, usage_;
+
+	// setproctitle() changes the command line and nothing else, so it is
+	// only noticed by reading the command line again
+	template <typename Type>
+	static size_t argv(kvm_t *kd, Type *proc)
+	{
+		size_t hash(0);
+
+		if (char **argv = kvm::getargv(kd, proc))
+			for (; *argv; ++argv)
+				hash = (hash ^ Names::hash(*argv)) * 16777619U;
+
+		return hash;
+	}
+
+public:
+	// the command lines only count when they are shown, and the usage
+	// only when it is shown or sorted by, since the CPU time of something
+	// is nearly always going up
+	Digest(uint32_t flags) : argv_(flags & (Arguments | ShowTitles)), usage_(flags & (ShowRss | ShowCpu | ShowThreads | RssSort | CpuSort | CountSort | RssTop | CpuTop)) {}
+
+	// true when anything differs from the last table seen
+	template <typename Type>
+	bool update(kvm_t *kd, Type *procs, int count)
+	{
+		typedef Type *Pointer;
+
+		next_.clear();
+		nextComms_.clear();
+
+		if (argv_ && count)
+		{
+			std::vector<Type *> pointers;
+
+			pointers.reserve(count);
+
+			_forall (Pointer, proc, procs, procs + count)
+				pointers.push_back(proc);
+
+			kvm::prefetch(kd, &pointers[0], pointers.size());
+		}
+
+		_forall (Pointer, proc, procs, procs + count)
+		{
+			const char *comm(kvm::comm(proc));
+			Record record = { kvm::pid(proc), kvm::ppid(proc), kvm::ruid(proc), nextComms_.size(), argv_ ? argv(kd, proc) : 0, usage_ ? kvm::rss(proc) : 0, usage_ ? kvm::cpu(proc) : 0, usage_ ? kvm::threads(proc) : 0 };
+
+			nextComms_.insert(nextComms_.end(), comm, comm + std::strlen(comm) + 1);
+			next_.push_back(record);
+		}
+
+		bool changed(next_.size() != records_.size() || nextComms_ != comms_);
+
+		for (size_t index(0); !changed && index != next_.size(); ++index)
+			changed = next_[index] != records_[index];
+
+		records_.swap(next_);
+		comms_.swap(nextComms_);
+
+		return changed;
+	}
+};
+
+// redraws a frame in place, rewriting only the lines that differ from what
+// is already on the terminal
+class Screen
+{
+	std::vector<std::string> lines_;
+	std::string output_;
+	size_t rows_;
+
+	inline void move(size_t row)
+	{
+		char move[32];
+
+		output_.append(move, std::sprintf(move, "\033[%lu;1H", static_cast<unsigned long>(row + 1)));
+	}
+
+public:
+	Screen() : rows_(0) {}
+
+	~Screen()
+	{
+		output_.clear();
+
+		move(std::min(lines_.size(), rows_ ? rows_ - 1 : 0));
+
+		output_ += '\n';
+
+		output(output_);
+	}
+
+	void paint(const std::string &frame)
+	{
+		size_t rows(::rows()), row(0);
+
+		output_.clear();
+
+		if (rows != rows_)
+		{
+			rows_ = rows;
+
+			lines_.clear();
+
+			output_ += "\033[H\033[2J";
+		}
+
+		// the last row is kept clear so the terminal never scrolls
+		for (size_t start(0); start < frame.size() && row != rows_ - 1; ++row)
+		{
+			size_t end(frame.find('\n', start));
+
+			if (end == std::string::npos)
+				end = frame.size();
+
+			if (row == lines_.size())
+				lines_.push_back(std::string());
+			else if (!lines_[row].compare(0, std::string::npos, frame, start, end - start))
+			{
+				start = end + 1;
+
+				continue;
+			}
+
+			lines_[row].assign(frame, start, end - start);
+
+			move(row);
+
+			output_ += lines_[row];
+			output_ += "\033[K";
+
+			start = end + 1;
+		}
+
+		for (size_t old(row); old < lines_.size(); ++old)
+		{
+			move(old);
+
+			output_ += "\033[K";
+		}
+
+		lines_.resize(row);
+
+		move(row);
+
+		output(output_);
+	}
+
+	inline void clear() { rows_ = 0; }
+};
+
+static volatile sig_atomic_t interrupted, resized;
+
+static void signaled(int signal)
+{
+	(signal == SIGWINCH ? resized : interrupted) = 1;
+}
+
+// keep the kvm handle and the last table between refreshes; a refresh
+// where nothing changed costs just the fetch, and one where something did
+// only rewrites the lines that moved
+template <typename Type, int Flags>
+static void watch(const Highlights &highlights, const Limits &limits, pid_t pid, uint32_t flags, uid_t uid, Matcher &matcher, double interval)
+{
+	char error[_POSIX2_LINE_MAX];
+	kvm_t *kd(kvm_openfiles(NULL, _PATH_DEVNULL, NULL, Flags, error));
+
+	if (!kd)
+		errx(1, "%s", error);
+
+	struct sigaction action;
+
+	std::memset(&action, 0, sizeof (action));
+
+	action.sa_handler = signaled;
+
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGWINCH, &action, NULL);
+
+	Digest digest(flags);
+	Screen screen;
+	Statistics stats(false);
+	std::string frame;
+
+	while (!interrupted)
+	{
+		int count;
+		Type *procs(kvm::getprocs<Type>(kd, count));
+
+		if (!procs)
+			errx(1, "%s", kvm_geterr(kd));
+
+		bool redraw(digest.update(kd, procs, count) || frame.empty());
+
+		if (resized)
+		{
+			resized = 0;
+			redraw = true;
+
+			screen.clear();
+		}
+
+		if (redraw)
+		{
+			frame.clear();
+
+			tree(kd, procs, count, highlights, limits, pid, flags, uid, matcher, stats, &frame);
+
+			screen.paint(frame);
 		}
+
+		timespec sleep;
+
+		sleep.tv_sec = static_cast<time_t>(interval);
+		sleep.tv_nsec = static_cast<long>((interval - sleep.tv_sec) * 1e9);
+
+		while (nanosleep(&sleep, &sleep) == -1 && errno == EINTR && !interrupted && !resized)
+			continue;
+	}
+}
+
+template <typename Type, int Flags>
+static void tree(const Highlights &highlights, const Limits &limits, pid_t pid, uint32_t flags, uid_t uid, const char *save, const snapshot::File *base, Matcher &matcher, Statistics &stats)
+{
+	char error[_POSIX2_LINE_MAX];
+	kvm_t *kd(kvm_openfiles(NULL, _PATH_DEVNULL, NULL, Flags, error));
+
+	if (!kd)
+		errx(1, "%s", error);
+
+	int count;
+	Type *procs(kvm::getprocs<Type>(kd, count));
+
+	if (!procs)
+		errx(1, "%s", kvm_geterr(kd));
+
+	stats.phase("fetch");
+
+	if (save)
+	{
+		snapshot::save(save, kd, procs, count);
+
+		stats.phase("save");
+	}
+
+	tree(kd, procs, count, base, highlights, limits, pid, flags, uid, matcher, stats);
+}
+
+static uid_t lookup(const char *user)
+{
+	errno = 0;
+
+	passwd *us3r(getpwnam(user));
+
+	if (!us3r)
+		errno ? err(1, NULL) : errx(1, "Unknown user: \"%s\"", user);
+
+	return us3r->pw_uid;
+}
+
+// whitespace separated pids, as from pgrep or a pid file
+static void readPids(const char *path, std::vector<pid_t> &pids)
+{
+	bool input(!std::strcmp(path, "-"));
+	FILE *file(input ? stdin : std::fopen(path, "r"));
+
+	if (!file)
+		err(1, "%s", path);
+
+	long pid;
+	int status;
+
+	while ((status = std::fscanf(file, "%ld", &pid)) == 1)
+	{
+		if (pid < 0 || pid > INT_MAX)
+			errx(1, "%s: Invalid PID: %ld", path, pid);
+
+		pids.push_back(pid);
 	}
 
-	_tforeach (typename Proc<Type>::PidMap, pid, pids)
-		delete pid->second;
+	if (std::ferror(file))
+		err(1, "%s", path);
+
+	if (status != EOF)
+		errx(1, "%s: Invalid PID list", path);
+
+	if (!input)
+		std::fclose(file);
 }
 
 int main(int argc, char *argv[])
 {
-	char *glob(NULL);
-	pid_t hpid(0), pid(0);
-	char *regex(NULL), *user(NULL);
-	uint16_t flags(options(argc, argv, glob, hpid, pid, regex, user));
+	char *glob(NULL), *huser(NULL), *hfile(NULL);
+	Highlights highlights;
+	Limits limits;
+	pid_t pid(0);
+	char *regex(NULL), *user(NULL), *base(NULL), *load(NULL), *save(NULL);
+	double interval(0);
+	uint32_t flags(options(argc, argv, glob, highlights.pids_, huser, hfile, pid, regex, user, base, load, save, interval, limits));
 	uid_t uid(0);
-
-	// TODO: glob and regex
+	Matcher matcher(flags, flags & Glob ? glob : regex);
 
 	if (flags & User)
+		uid = lookup(user);
+
+	if (flags & HighlightUser)
+		highlights.uid_ = lookup(huser);
+
+	if (hfile)
+		readPids(hfile, highlights.pids_);
+
+	if (flags & Watch)
+	{
+		if (base || load || save)
+			errx(1, "--watch cannot be used with snapshots");
+
+		watch<kvm::Proc, kvm::Flags>(highlights, limits, pid, flags, uid, matcher, interval);
+
+		return 0;
+	}
+
+	Statistics stats(flags & Stats);
+	snapshot::File *older(base ? new snapshot::File(base) : NULL);
+
+	if (load)
 	{
-		errno = 0;
+		snapshot::File file(load);
+
+		stats.phase("fetch");
 
-		passwd *us3r(getpwnam(user));
+		if (save)
+		{
+			snapshot::save(save, NULL, file.procs(), file.count());
 
-		if (!us3r)
-			errno ? err(1, NULL) : errx(1, "Unknown user: \"%s\"", user);
+			stats.phase("save");
+		}
 
-		uid = us3r->pw_uid;
+		tree<snapshot::Proc>(NULL, file.procs(), file.count(), older, highlights, limits, pid, flags, uid, matcher, stats);
 	}
+	else
+		tree<kvm::Proc, kvm::Flags>(highlights, limits, pid, flags, uid, save, older, matcher, stats);
+
+	delete older;
 
-	tree<kvm::Proc, kvm::Flags>(hpid, pid, flags, uid);
+	stats.print();
 
 	return 0;
 }
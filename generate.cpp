@@ -0,0 +1,191 @@
+// DT PS Tree
+//
+// Douglas Thrift
+//
+// generate.cpp
+
+/*  Copyright 2010 Douglas Thrift
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <err.h>
+
+#include "foreach.hpp"
+#include "snapshot.hpp"
+
+// the same tables every time, so runs can be compared
+class Random
+{
+	uint32_t state_;
+
+public:
+	Random() : state_(2463534242U) {}
+
+	inline uint32_t operator()(uint32_t limit)
+	{
+		state_ ^= state_ << 13;
+		state_ ^= state_ >> 17;
+		state_ ^= state_ << 5;
+
+		return state_ % limit;
+	}
+};
+
+class Table
+{
+	snapshot::Writer writer_;
+	pid_t next_;
+	std::vector<std::string> args_;
+	std::vector<char *> argv_;
+
+public:
+	Table(unsigned count) : next_(1)
+	{
+		writer_.reserve(count);
+	}
+
+	pid_t add(pid_t ppid, const std::string &comm, unsigned argc = 1, size_t size = 0)
+	{
+		pid_t pid(next_++);
+
+		args_.assign(1, comm);
+
+		_repeat (argc - 1)
+		{
+			std::string arg("--argument-");
+
+			arg += std::string(1, 'a' + _index % 26);
+
+			if (arg.size() < size)
+				arg.append(size - arg.size(), 'x');
+
+			args_.push_back(arg);
+		}
+
+		argv_.clear();
+
+		_tforeach (std::vector<std::string>, arg, args_)
+			argv_.push_back(const_cast<char *>(arg->c_str()));
+
+		argv_.push_back(NULL);
+
+		snapshot::Proc record;
+
+		record.pid_ = pid;
+		record.ppid_ = ppid;
+		record.ruid_ = pid % 3 ? 0 : 1000 + pid % 7;
+		record.start_ = pid;
+
+		// something to add up for --show-usage and --sort-by
+		record.threads_ = pid % 5 == 4 ? 16 : 1;
+		record.rss_ = (1 + pid % 97) * 65536;
+		record.cpu_ = pid % 13 * 250000;
+
+		writer_.add(record, comm.c_str(), &argv_[0]);
+
+		return pid;
+	}
+
+	inline unsigned size() const { return next_ - 1; }
+	inline void write(const char *path) { writer_.write(path); }
+};
+
+static std::string number(const char *prefix, unsigned value)
+{
+	char buffer[32];
+
+	std::snprintf(buffer, sizeof (buffer), "%s%u", prefix, value);
+
+	return buffer;
+}
+
+static void usage(const char *program)
+{
+	std::fprintf(stderr, "Usage: %s chain|wide|pools|argv|multibyte|mixed COUNT FILE\n", program);
+	std::exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 4)
+		usage(argv[0]);
+
+	std::string shape(argv[1]);
+	char *end;
+	unsigned long count(std::strtoul(argv[2], &end, 0));
+
+	if (end == argv[2] || *end != '\0' || count < 2 || count > 10000000)
+		errx(1, "Invalid count: \"%s\"", argv[2]);
+
+	Table table(count);
+	Random random;
+	pid_t init(table.add(0, "init"));
+
+	// one long line of descent
+	if (shape == "chain")
+		for (pid_t parent(init); table.size() < count;)
+			parent = table.add(parent, number("chain", table.size() % 10));
+	// everything a child of init and no two names alike
+	else if (shape == "wide")
+		while (table.size() < count)
+			table.add(init, number("worker", table.size()));
+	// many copies of the same master and its workers, which compact down to
+	// a handful of lines
+	else if (shape == "pools")
+		while (table.size() < count)
+		{
+			pid_t master(table.add(init, "httpd", 3, 16));
+
+			for (unsigned index(0); index != 32 && table.size() < count; ++index)
+				table.add(master, "httpd", 3, 16);
+		}
+	// long command lines for --arguments and --show-titles
+	else if (shape == "argv")
+		while (table.size() < count)
+			table.add(random(table.size()) + 1, number("java", random(8)), 16, 48);
+	// names that have to be escaped or measured a character at a time
+	else if (shape == "multibyte")
+	{
+		static const char *names[] = { "процесс", "進程", "プロセス", "διεργασία", "프로세스", "tâche" };
+
+		while (table.size() < count)
+			table.add(random(table.size()) + 1, names[random(sizeof (names) / sizeof (*names))] + number("-", random(4)));
+	}
+	// something like a busy machine: shallow and bushy with a few common
+	// names repeated under many parents
+	else if (shape == "mixed")
+	{
+		static const char *names[] = { "sh", "bash", "sshd", "cron", "python", "postgres", "nginx", "kworker" };
+
+		while (table.size() < count)
+		{
+			pid_t parent(random(4) ? random(table.size()) + 1 : init);
+
+			table.add(parent, names[random(sizeof (names) / sizeof (*names))], 1 + random(4), random(32));
+		}
+	}
+	else
+		usage(argv[0]);
+
+	table.write(argv[3]);
+
+	return 0;
+}
+
+// generate synthetic process tables for benchmarking
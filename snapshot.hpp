@@ -0,0 +1,218 @@
+// DT PS Tree
+//
+// Douglas Thrift
+//
+// snapshot.hpp
+
+/*  Copyright 2010 Douglas Thrift
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _snapshot_hpp_
+#define _snapshot_hpp_
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "foreach.hpp"
+
+namespace snapshot
+{
+
+const char Magic[8] = { 'D', 'T', 'P', 'S', 'T', 'R', 'E', 'E' };
+const uint32_t Order(0x01020304), Version(3);
+
+// a header, count records and then a table of NUL terminated strings; the
+// argv of a record is argc_ strings back to back
+struct Header
+{
+	char magic_[8];
+	uint32_t order_, version_, count_, size_;
+};
+
+// strings are found at byte offsets from the record itself so a mapped
+// record can be used in place without knowing where the file starts; start_
+// is only meaningful compared with another start_ from the same machine,
+// rss_ is in bytes and cpu_ in microseconds
+struct Proc
+{
+	int32_t pid_, ppid_;
+	uint32_t ruid_, argc_, comm_, argv_, threads_, reserved_;
+	uint64_t start_, rss_, cpu_;
+
+	inline char *string(uint32_t offset) const
+	{
+		return const_cast<char *>(reinterpret_cast<const char *>(this) + offset);
+	}
+};
+
+class Writer
+{
+	std::vector<Proc> records_;
+	std::vector<char> strings_;
+
+public:
+	inline void reserve(size_t count) { records_.reserve(count); }
+
+	// the numbers come from record and the strings from comm and argv,
+	// which is NULL terminated and may itself be NULL
+	void add(Proc record, const char *comm, char **argv)
+	{
+		record.argc_ = 0;
+		record.reserved_ = 0;
+		record.comm_ = strings_.size();
+
+		strings_.insert(strings_.end(), comm, comm + std::strlen(comm) + 1);
+
+		record.argv_ = strings_.size();
+
+		if (argv)
+			for (; *argv; ++argv, ++record.argc_)
+				strings_.insert(strings_.end(), *argv, *argv + std::strlen(*argv) + 1);
+
+		records_.push_back(record);
+	}
+
+	// turns the string table offsets into record relative ones, so this
+	// can only be done once
+	void write(const char *path)
+	{
+		size_t table(sizeof (Header) + records_.size() * sizeof (Proc));
+
+		if (table + strings_.size() > UINT32_MAX)
+			errx(1, "%s: %s", path, std::strerror(EFBIG));
+
+		_forall (std::vector<Proc>::iterator, record, records_.begin(), records_.end())
+		{
+			uint32_t offset(table - sizeof (Header) - _index * sizeof (Proc));
+
+			record->comm_ += offset;
+			record->argv_ += offset;
+		}
+
+		Header header;
+
+		std::memcpy(header.magic_, Magic, sizeof (Magic));
+
+		header.order_ = Order;
+		header.version_ = Version;
+		header.count_ = records_.size();
+		header.size_ = strings_.size();
+
+		FILE *file(std::fopen(path, "wb"));
+
+		if (!file)
+			err(1, "%s", path);
+
+		std::fwrite(&header, sizeof (header), 1, file);
+
+		if (!records_.empty())
+			std::fwrite(&records_[0], sizeof (Proc), records_.size(), file);
+
+		if (!strings_.empty())
+			std::fwrite(&strings_[0], 1, strings_.size(), file);
+
+		if (std::ferror(file) | std::fclose(file))
+			err(1, "%s", path);
+	}
+};
+
+class File
+{
+	void *map_;
+	size_t size_;
+	const Header *header_;
+
+public:
+	File(const char *path)
+	{
+		int fd(open(path, O_RDONLY));
+		struct stat status;
+
+		if (fd == -1 || fstat(fd, &status))
+			err(1, "%s", path);
+
+		size_ = status.st_size;
+
+		if (size_ < sizeof (Header))
+			errx(1, "%s: Not a snapshot", path);
+
+		map_ = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		close(fd);
+
+		if (map_ == MAP_FAILED)
+			err(1, "%s", path);
+
+		header_ = static_cast<const Header *>(map_);
+
+		if (std::memcmp(header_->magic_, Magic, sizeof (Magic)))
+			errx(1, "%s: Not a snapshot", path);
+
+		if (header_->order_ != Order)
+			errx(1, "%s: Snapshot has the wrong byte order", path);
+
+		if (header_->version_ != Version)
+			errx(1, "%s: Unsupported snapshot version %u", path, header_->version_);
+
+		size_t table(sizeof (Header) + static_cast<size_t>(header_->count_) * sizeof (Proc));
+
+		if (table + header_->size_ != size_ || header_->size_ && static_cast<const char *>(map_)[size_ - 1])
+			errx(1, "%s: Snapshot is truncated or corrupt", path);
+
+		typedef const Proc *Pointer;
+		const char *end(static_cast<const char *>(map_) + size_);
+
+		// every string is NUL terminated by the end of the table at the
+		// latest, so checking where each one starts is enough
+		_forall (Pointer, proc, procs(), procs() + count())
+		{
+			size_t offset(table - sizeof (Header) - _index * sizeof (Proc));
+
+			if (proc->comm_ < offset || proc->comm_ - offset >= header_->size_ || proc->argc_ && (proc->argv_ < offset || proc->argv_ - offset >= header_->size_))
+				errx(1, "%s: Snapshot is truncated or corrupt", path);
+
+			const char *arg(proc->string(proc->argv_));
+
+			_repeat (proc->argc_)
+			{
+				if (arg >= end)
+					errx(1, "%s: Snapshot is truncated or corrupt", path);
+
+				arg += std::strlen(arg) + 1;
+			}
+		}
+	}
+
+	~File()
+	{
+		munmap(map_, size_);
+	}
+
+	inline Proc *procs() const { return const_cast<Proc *>(reinterpret_cast<const Proc *>(header_ + 1)); }
+	inline int count() const { return header_->count_; }
+};
+
+}
+
+#endif//_snapshot_hpp_